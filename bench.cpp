@@ -0,0 +1,341 @@
+#define CL_TARGET_OPENCL_VERSION 120
+#include <chrono>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+#include <CL/cl.h>
+#include "ocl_helpers.h"
+#include "ocl_device.h"
+#include "ocl_gemm.h"
+#include "ocl_profiling.h"
+#include "ocl_precision.h"
+#include "ocl_cpu_gemm.h"
+#include "ocl_bench.h"
+
+using namespace std;
+using namespace ocl;
+
+//
+// GEMM benchmark over a grid of shapes, precisions and devices:
+//
+//   bench [--shapes 512,1024,256x4096x64] [--precisions 16,32,64] [--devices all|0,2] [--cpu]
+//         [--warmup 2] [--reps 10] [--seed 1] [--tune]
+//         [--csv out.csv] [--json out.json] [--baseline base.csv] [--threshold 0.05]
+//
+// A shape is MxNxK or one number for a cube. Every point is measured in a context, queue and
+// gemm built beforehand, so only uploads, kernel and download are timed: warmup repetitions
+// first, then reps timed ones, from which min / median / p95 are reported. Input data come
+// from a fixed seed. With --baseline the run is compared to a CSV from an earlier run, and
+// the exit status is 2 if any point got slower by more than the threshold.
+//
+
+struct options {
+    vector<vector<size_t>> shapes = {{256, 256, 256}, {1024, 1024, 1024}};
+    vector<int> precisions = {32};
+    vector<size_t> devices;     // indices into get_devices(), empty for all
+    bool cpu = false;
+    bool tune = false;
+    int warmup = 2;
+    int reps = 10;
+    unsigned seed = 1;
+    string csv;
+    string json;
+    string baseline;
+    double threshold = 0.05;
+};
+
+
+vector<string> split(const string& s, char sep) {
+    vector<string> res;
+    size_t b = 0;
+    while (b <= s.size()) {
+        size_t e = s.find(sep, b);
+        if (e == string::npos)
+            e = s.size();
+        if (e > b)
+            res.push_back(s.substr(b, e - b));
+        b = e + 1;
+    }
+    return res;
+}
+
+
+options parse(int argc, char* argv[]) {
+    options o;
+    for (int i = 1; i < argc; ++i) {
+        const string a = argv[i];
+        auto value = [&]() -> string {
+            if (i + 1 >= argc)
+                throw invalid_argument(a + ": value expected");
+            return argv[++i];
+        };
+
+        if (a == "--shapes") {
+            o.shapes.clear();
+            for (const auto& s : split(value(), ',')) {
+                vector<size_t> d;
+                for (const auto& x : split(s, 'x'))
+                    d.push_back(stoul(x));
+                if (d.size() == 1)
+                    d = {d[0], d[0], d[0]};
+                if (d.size() != 3 || d[0] == 0 || d[1] == 0 || d[2] == 0)
+                    throw invalid_argument("bad shape " + s);
+                // the kernels take the dimensions as int
+                if (d[0] > size_t(INT_MAX) || d[1] > size_t(INT_MAX) || d[2] > size_t(INT_MAX))
+                    throw invalid_argument("shape " + s + " has a dimension above INT_MAX");
+                o.shapes.push_back(d);
+            }
+        }
+        else if (a == "--precisions") {
+            o.precisions.clear();
+            for (const auto& s : split(value(), ',')) {
+                const int p = stoi(s);
+                if (p != 16 && p != 32 && p != 64)
+                    throw invalid_argument("bad precision " + s);
+                o.precisions.push_back(p);
+            }
+        }
+        else if (a == "--devices") {
+            const string v = value();
+            if (v != "all")
+                for (const auto& s : split(v, ','))
+                    o.devices.push_back(stoul(s));
+        }
+        else if (a == "--cpu")
+            o.cpu = true;
+        else if (a == "--tune")
+            o.tune = true;
+        else if (a == "--warmup")
+            o.warmup = stoi(value());
+        else if (a == "--reps")
+            o.reps = max(1, stoi(value()));
+        else if (a == "--seed")
+            o.seed = stoul(value());
+        else if (a == "--csv")
+            o.csv = value();
+        else if (a == "--json")
+            o.json = value();
+        else if (a == "--baseline")
+            o.baseline = value();
+        else if (a == "--threshold")
+            o.threshold = stod(value());
+        else
+            throw invalid_argument("unknown option " + a);
+    }
+    return o;
+}
+
+
+template<typename T>
+matrix<T> random_matrix(size_t rows, size_t cols, mt19937& rng) {
+    uniform_real_distribution<float> d(-1, 1);
+    matrix<T> m(rows, cols);
+    for (auto& x : m.items)
+        x = T(d(rng));
+    return m;
+}
+
+
+double ms_since(chrono::steady_clock::time_point s) {
+    return chrono::duration<double, milli>(chrono::steady_clock::now() - s).count();
+}
+
+
+template<typename Storage>
+bench_result bench_gemm(const device_description& dd, const vector<size_t>& shape, const options& o,
+                        program_cache* cache, tuning_table* tuning) {
+    const int M = shape[0], N = shape[1], K = shape[2];
+
+    bench_result r;
+    r.device = dd.name;
+    r.driver = get_device_data<string>(dd.id, CL_DRIVER_VERSION);
+    r.precision = precision<Storage>::name();
+    r.M = M;
+    r.N = N;
+    r.K = K;
+
+    // the same data for every device and run
+    mt19937 rng(o.seed);
+    const auto a = random_matrix<Storage>(M, K, rng);
+    const auto bt = random_matrix<Storage>(N, K, rng);
+    matrix<Storage> c(M, N);
+
+    context ctx(dd.id, cache);
+    command_queue q = ctx.create_queue(CL_QUEUE_PROFILING_ENABLE);
+
+    if (o.tune && precision<Storage>::bits == 32) {
+        gemm_config cfg;
+        if (!find_tuned_gemm(*tuning, dd, M, N, K, &cfg)) {
+            command_queue tq = ctx.create_queue();
+            tune_sgemm(*tuning, ctx, tq, dd, M, N, K);
+        }
+    }
+
+    gemm<Storage> g(ctx, dd, M, N, K, tuning);
+    stringstream cfg;
+    cfg << g.cfg;
+    r.config = cfg.str();
+
+    mem_buffer a_mem = ctx.create_buffer(CL_MEM_READ_ONLY, a.size() * sizeof(Storage));
+    mem_buffer b_mem = ctx.create_buffer(CL_MEM_READ_ONLY, bt.size() * sizeof(Storage));
+    mem_buffer c_mem = ctx.create_buffer(CL_MEM_WRITE_ONLY, c.size() * sizeof(Storage));
+
+    vector<double> kernel, transfer, wall;
+    for (int i = 0; i < o.warmup + o.reps; ++i) {
+        const auto s = chrono::steady_clock::now();
+        q.write_buffer_async(a_mem.m, 0, a);
+        q.write_buffer_async(b_mem.m, 0, bt);
+        g.run(q, M, N, K, a_mem.m, b_mem.m, c_mem.m);
+        q.read_buffer_async(c_mem.m, 0, &c);
+        q.finish();
+        const double w = ms_since(s);
+
+        auto prof = get_profile(q);
+        if (i < o.warmup)
+            continue;
+        kernel.push_back(prof.kernel_ms);
+        transfer.push_back(prof.transfer_ms);
+        wall.push_back(w);
+    }
+
+    r.kernel = summarize(kernel);
+    r.transfer = summarize(transfer);
+    r.wall = summarize(wall);
+    r.set_rates(sizeof(Storage));
+    return r;
+}
+
+
+// the host baseline: no transfers, kernel time is the whole multiplication
+bench_result bench_cpu(const vector<size_t>& shape, const options& o) {
+    const size_t M = shape[0], N = shape[1], K = shape[2];
+    cpu_gemm g;
+
+    bench_result r;
+    r.device = "cpu";
+    r.driver = g.isa_name();
+    r.precision = precision<cl_float>::name();
+    r.M = M;
+    r.N = N;
+    r.K = K;
+    r.config = to_string(g.pool.size()) + " threads";
+
+    mt19937 rng(o.seed);
+    const auto a = random_matrix<cl_float>(M, K, rng);
+    const auto bt = random_matrix<cl_float>(N, K, rng);
+    matrix<cl_float> c(M, N);
+
+    vector<double> times;
+    for (int i = 0; i < o.warmup + o.reps; ++i) {
+        const auto s = chrono::steady_clock::now();
+        g.run(a, bt, c);
+        if (i >= o.warmup)
+            times.push_back(ms_since(s));
+    }
+
+    r.kernel = r.wall = summarize(times);
+    r.transfer.count = r.kernel.count;
+    r.set_rates(sizeof(cl_float));
+    return r;
+}
+
+
+int main(int argc, char* argv[]) {
+    options o;
+    try {
+        o = parse(argc, argv);
+    }
+    catch (exception& e) {
+        cerr << "bench: " << e.what() << "\n";
+        return 1;
+    }
+
+    vector<device_description> all;
+    try {
+        all = get_devices();
+    }
+    catch (clexception& e) {
+        cerr << "no OpenCL platform: " << e.what() << "\n";
+    }
+
+    vector<const device_description*> devices;
+    for (size_t i = 0; i < all.size(); ++i)
+        if (o.devices.empty() || find(o.devices.begin(), o.devices.end(), i) != o.devices.end())
+            devices.push_back(&all[i]);
+
+    program_cache cache;
+    tuning_table tuning;
+    vector<bench_result> results;
+
+    auto report = [&](const bench_result& r) {
+        cout << r.device << ", " << r.precision << " " << r.M << "x" << r.N << "x" << r.K
+             << ": kernel " << r.kernel.min << " / " << r.kernel.median << " / " << r.kernel.p95 << " ms"
+             << ", transfer " << r.transfer.median << " ms, " << r.gflops << " GFLOPS, " << r.gbps << " GB/s ("
+             << r.config << ")" << endl;
+        results.push_back(r);
+    };
+
+    for (const auto& shape : o.shapes) {
+        if (o.cpu)
+            report(bench_cpu(shape, o));
+
+        for (const auto* dd : devices) {
+            for (int p : o.precisions) {
+                try {
+                    if (p == 16)
+                        report(bench_gemm<half>(*dd, shape, o, &cache, &tuning));
+                    else if (p == 64)
+                        report(bench_gemm<cl_double>(*dd, shape, o, &cache, &tuning));
+                    else
+                        report(bench_gemm<cl_float>(*dd, shape, o, &cache, &tuning));
+                }
+                catch (clexception& e) {
+                    // no fp64, too big for the device: the rest of the grid still runs
+                    cerr << dd->name << ", " << p << " bit " << shape[0] << "x" << shape[1] << "x" << shape[2]
+                         << ": skipped, " << e.what() << "\n";
+                }
+            }
+        }
+    }
+
+    if (!o.csv.empty()) {
+        ofstream f(o.csv);
+        write_csv(f, results);
+    }
+
+    if (!o.json.empty()) {
+        char date[32];
+        const time_t now = time(NULL);
+        strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+
+        ofstream f(o.json);
+        write_json(f, results, {
+            {"date", date},
+            {"warmup", to_string(o.warmup)},
+            {"reps", to_string(o.reps)},
+            {"seed", to_string(o.seed)},
+        });
+    }
+
+    int status = 0;
+    if (!o.baseline.empty()) {
+        ifstream f(o.baseline);
+        if (!f) {
+            cerr << "bench: cannot read " << o.baseline << "\n";
+            return 1;
+        }
+        for (const auto& ch : compare(read_csv(f), results, o.threshold)) {
+            cout << (ch.regression() ? "REGRESSION " : "improvement ") << ch.now.key() << ": "
+                 << ch.base.gflops << " -> " << ch.now.gflops << " GFLOPS (" << (ch.ratio - 1) * 100 << "%)\n";
+            if (ch.regression())
+                status = 2;
+        }
+    }
+    return status;
+}
@@ -0,0 +1,124 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <limits>
+#include <map>
+#include <string>
+#include <vector>
+#include <CL/cl.h>
+
+#include "ocl_error.h"
+#include "ocl_device.h"
+#include "ocl_helpers.h"
+#include "ocl_tuning_table.h"
+
+namespace ocl {
+
+    // One configuration to try: a kernel variant (build options) and an NDRange for it
+    struct tune_candidate {
+        std::string options;
+        size_t dims;
+        size_t global[2];
+        size_t local[2];
+    };
+
+
+    // Benchmarks every candidate on the given context and queue and stores the fastest one
+    // in the table under (device, kernel_name, shape). Each variant is built once, set_args
+    // binds the arguments of its kernel. Candidates which exceed CL_KERNEL_WORK_GROUP_SIZE of
+    // their variant, or which the driver refuses to launch, are skipped.
+    // The time of a candidate is the best of `repeats` launches after one warm-up launch.
+    // If measured is not NULL it receives the time of every candidate that ran.
+    tuned_config tune(tuning_table& table, context& ctx, command_queue& q,
+                      const char* code, const char* kernel_name, const std::vector<size_t>& shape,
+                      const std::vector<tune_candidate>& candidates,
+                      const std::function<void(kernel&)>& set_args,
+                      int repeats = 3, std::vector<tuned_config>* measured = NULL)
+    {
+        std::map<std::string, std::vector<const tune_candidate*>> variants;
+        for (const auto& c : candidates)
+            variants[c.options].push_back(&c);
+
+        tuned_config best;
+        best.ms = std::numeric_limits<double>::max();
+
+        for (const auto& v : variants) {
+            program p = ctx.create_program(code, v.first.c_str());
+            kernel& k = p.get_kernel(kernel_name);
+            set_args(k);
+            const size_t limit = k.work_group_size(ctx.did);
+
+            for (auto c : v.second) {
+                size_t global[] = {c->global[0], c->global[1]};
+                size_t local[] = {c->local[0], c->local[1]};
+                if ((c->dims == 1 ? local[0] : local[0] * local[1]) > limit)
+                    continue;
+
+                double ms = std::numeric_limits<double>::max();
+                try {
+                    q.run(k.k, c->dims, global, local);
+                    q.finish();
+                    for (int r = 0; r < repeats; ++r) {
+                        auto start = std::chrono::steady_clock::now();
+                        q.run(k.k, c->dims, global, local);
+                        q.finish();
+                        std::chrono::duration<double, std::milli> d = std::chrono::steady_clock::now() - start;
+                        ms = std::min(ms, d.count());
+                    }
+                }
+                catch (clexception& e) {
+                    if (e.ret != CL_INVALID_WORK_GROUP_SIZE && e.ret != CL_OUT_OF_RESOURCES)
+                        throw;
+                    continue;
+                }
+
+                tuned_config t;
+                t.options = c->options;
+                t.local[0] = local[0];
+                t.local[1] = (c->dims > 1) ? local[1] : 0;
+                t.ms = ms;
+                if (measured != NULL)
+                    measured->push_back(t);
+                if (ms < best.ms)
+                    best = t;
+            }
+        }
+
+        if (best.ms == std::numeric_limits<double>::max()) {
+            clexception e(CL_INVALID_WORK_GROUP_SIZE);
+            e << "tune: no candidate of " << kernel_name << " can run on the device";
+            throw e;
+        }
+
+        table.store(get_device_data<std::string>(ctx.did, CL_DEVICE_NAME), kernel_name, shape, best);
+        table.save();
+        return best;
+    }
+
+
+    // Candidates for run1d/run2d: every local size from `sizes` (both dimensions for 2D)
+    // which divides the range and fits the device, for every variant
+    std::vector<tune_candidate> work_group_candidates(const device_description& dd, const std::vector<size_t>& range,
+                                                      const std::vector<size_t>& sizes,
+                                                      const std::vector<std::string>& variants = {""})
+    {
+        std::vector<tune_candidate> res;
+        for (const auto& v : variants) {
+            for (auto s0 : sizes) {
+                if (range[0] % s0 != 0 || s0 > dd.max_work_group)
+                    continue;
+                if (range.size() == 1) {
+                    res.push_back({v, 1, {range[0], 0}, {s0, 0}});
+                    continue;
+                }
+                for (auto s1 : sizes) {
+                    if (range[1] % s1 != 0 || s0 * s1 > dd.max_work_group)
+                        continue;
+                    res.push_back({v, 2, {range[0], range[1]}, {s0, s1}});
+                }
+            }
+        }
+        return res;
+    }
+}
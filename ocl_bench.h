@@ -0,0 +1,261 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+#include <istream>
+#include <map>
+#include <ostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace ocl {
+
+    // Order statistics of repeated timings, milliseconds
+    struct sample_stats {
+        size_t count = 0;
+        double min = 0;
+        double median = 0;
+        double p95 = 0;     // nearest rank
+        double mean = 0;
+    };
+
+
+    sample_stats summarize(std::vector<double> x) {
+        sample_stats res;
+        if (x.empty())
+            return res;
+        std::sort(x.begin(), x.end());
+        res.count = x.size();
+        res.min = x.front();
+        res.median = (x.size() % 2) ? x[x.size() / 2] : (x[x.size() / 2 - 1] + x[x.size() / 2]) / 2;
+        res.p95 = x[std::min(x.size() - 1, size_t(std::ceil(0.95 * x.size())) - 1)];
+        double sum = 0;
+        for (auto v : x)
+            sum += v;
+        res.mean = sum / x.size();
+        return res;
+    }
+
+
+    // One point of a benchmark grid. Rates are computed from the medians: gflops and gbps
+    // from the kernel time (gbps counts every matrix read or written once), transfer_gbps
+    // from the time of the uploads and downloads.
+    struct bench_result {
+        std::string device;
+        std::string driver;
+        std::string precision;
+        size_t M = 0;
+        size_t N = 0;
+        size_t K = 0;
+        std::string config;
+        sample_stats kernel;
+        sample_stats transfer;
+        sample_stats wall;      // host time of one repetition: uploads, kernel, download
+        double gflops = 0;
+        double gbps = 0;
+        double transfer_gbps = 0;
+
+        // identifies the point across runs, for baseline comparison
+        std::string key() const {
+            std::stringstream s;
+            s << device << '/' << precision << '/' << M << 'x' << N << 'x' << K;
+            return s.str();
+        }
+
+        void set_rates(size_t item_size) {
+            // the kernel reads A and Bt and writes C, the transfers move the same bytes
+            const double bytes = double(M * K + N * K + M * N) * item_size;
+            gflops = kernel.median > 0 ? 2.0 * M * N * K / kernel.median / 1e6 : 0;
+            gbps = kernel.median > 0 ? bytes / kernel.median / 1e6 : 0;
+            transfer_gbps = transfer.median > 0 ? bytes / transfer.median / 1e6 : 0;
+        }
+    };
+
+
+    std::string csv_field(const std::string& s) {
+        if (s.find_first_of(",\"\n") == std::string::npos)
+            return s;
+        std::string res = "\"";
+        for (char c : s) {
+            if (c == '"')
+                res += '"';
+            res += c;
+        }
+        return res + "\"";
+    }
+
+
+    std::vector<std::string> csv_split(const std::string& line) {
+        std::vector<std::string> res(1);
+        bool quoted = false;
+        for (size_t i = 0; i < line.size(); ++i) {
+            const char c = line[i];
+            if (quoted) {
+                if (c == '"' && i + 1 < line.size() && line[i + 1] == '"')
+                    res.back() += line[++i];
+                else if (c == '"')
+                    quoted = false;
+                else
+                    res.back() += c;
+            }
+            else if (c == '"')
+                quoted = true;
+            else if (c == ',')
+                res.emplace_back();
+            else
+                res.back() += c;
+        }
+        return res;
+    }
+
+
+    const char* bench_csv_header =
+        "device,driver,precision,M,N,K,config,reps,"
+        "kernel_min_ms,kernel_median_ms,kernel_p95_ms,transfer_min_ms,transfer_median_ms,transfer_p95_ms,"
+        "wall_min_ms,wall_median_ms,wall_p95_ms,gflops,gbps,transfer_gbps";
+
+
+    void write_csv(std::ostream& str, const std::vector<bench_result>& results) {
+        str << bench_csv_header << "\n" << std::setprecision(6);
+        for (const auto& r : results) {
+            str << csv_field(r.device) << ',' << csv_field(r.driver) << ',' << r.precision << ','
+                << r.M << ',' << r.N << ',' << r.K << ',' << csv_field(r.config) << ',' << r.kernel.count;
+            for (const auto* s : {&r.kernel, &r.transfer, &r.wall})
+                str << ',' << s->min << ',' << s->median << ',' << s->p95;
+            str << ',' << r.gflops << ',' << r.gbps << ',' << r.transfer_gbps << "\n";
+        }
+    }
+
+
+    // Reads what write_csv wrote; columns are found by name, so files from older versions
+    // with fewer columns still load
+    std::vector<bench_result> read_csv(std::istream& str) {
+        std::vector<bench_result> res;
+        std::string line;
+        if (!std::getline(str, line))
+            return res;
+
+        std::map<std::string, size_t> column;
+        const auto names = csv_split(line);
+        for (size_t i = 0; i < names.size(); ++i)
+            column[names[i]] = i;
+        for (const char* c : {"device", "precision", "M", "N", "K", "gflops"})
+            if (!column.count(c))
+                throw std::invalid_argument(std::string("read_csv: no column ") + c);
+
+        while (std::getline(str, line)) {
+            if (line.empty())
+                continue;
+            const auto f = csv_split(line);
+            auto get = [&](const char* name) -> std::string {
+                auto it = column.find(name);
+                return (it != column.end() && it->second < f.size()) ? f[it->second] : std::string();
+            };
+            auto num = [&](const char* name) {
+                const std::string s = get(name);
+                return s.empty() ? 0.0 : std::stod(s);
+            };
+
+            bench_result r;
+            r.device = get("device");
+            r.driver = get("driver");
+            r.precision = get("precision");
+            r.M = size_t(num("M"));
+            r.N = size_t(num("N"));
+            r.K = size_t(num("K"));
+            r.config = get("config");
+            r.kernel.count = r.transfer.count = r.wall.count = size_t(num("reps"));
+            r.kernel.min = num("kernel_min_ms");
+            r.kernel.median = num("kernel_median_ms");
+            r.kernel.p95 = num("kernel_p95_ms");
+            r.transfer.min = num("transfer_min_ms");
+            r.transfer.median = num("transfer_median_ms");
+            r.transfer.p95 = num("transfer_p95_ms");
+            r.wall.min = num("wall_min_ms");
+            r.wall.median = num("wall_median_ms");
+            r.wall.p95 = num("wall_p95_ms");
+            r.gflops = num("gflops");
+            r.gbps = num("gbps");
+            r.transfer_gbps = num("transfer_gbps");
+            res.push_back(r);
+        }
+        return res;
+    }
+
+
+    std::string json_string(const std::string& s) {
+        std::stringstream res;
+        res << '"';
+        for (unsigned char c : s) {
+            if (c == '"' || c == '\\')
+                res << '\\' << c;
+            else if (c < 0x20)
+                res << "\\u" << std::hex << std::setw(4) << std::setfill('0') << int(c) << std::dec;
+            else
+                res << c;
+        }
+        res << '"';
+        return res.str();
+    }
+
+
+    // {"meta": {...}, "results": [...]}; meta holds run parameters as strings
+    void write_json(std::ostream& str, const std::vector<bench_result>& results, const std::map<std::string, std::string>& meta) {
+        auto stats = [&](const char* name, const sample_stats& s) {
+            str << json_string(name) << ": {\"min_ms\": " << s.min << ", \"median_ms\": " << s.median
+                << ", \"p95_ms\": " << s.p95 << ", \"mean_ms\": " << s.mean << "}";
+        };
+
+        str << std::setprecision(6) << "{\n  \"meta\": {";
+        bool first = true;
+        for (const auto& m : meta) {
+            str << (first ? "" : ",") << "\n    " << json_string(m.first) << ": " << json_string(m.second);
+            first = false;
+        }
+        str << "\n  },\n  \"results\": [";
+        for (size_t i = 0; i < results.size(); ++i) {
+            const auto& r = results[i];
+            str << (i ? "," : "") << "\n    {\"device\": " << json_string(r.device) << ", \"driver\": " << json_string(r.driver)
+                << ", \"precision\": " << json_string(r.precision) << ", \"M\": " << r.M << ", \"N\": " << r.N << ", \"K\": " << r.K
+                << ", \"config\": " << json_string(r.config) << ", \"reps\": " << r.kernel.count << ",\n     ";
+            stats("kernel", r.kernel);
+            str << ",\n     ";
+            stats("transfer", r.transfer);
+            str << ",\n     ";
+            stats("wall", r.wall);
+            str << ",\n     \"gflops\": " << r.gflops << ", \"gbps\": " << r.gbps << ", \"transfer_gbps\": " << r.transfer_gbps << "}";
+        }
+        str << "\n  ]\n}\n";
+    }
+
+
+    // Point whose median throughput moved by more than the threshold against the baseline
+    struct bench_change {
+        bench_result base;
+        bench_result now;
+        double ratio;       // now / base GFLOPS
+
+        bool regression() const { return ratio < 1; }
+    };
+
+
+    // Changes beyond `threshold` (0.05 = 5%) for the points present in both runs
+    std::vector<bench_change> compare(const std::vector<bench_result>& base, const std::vector<bench_result>& now, double threshold) {
+        std::map<std::string, const bench_result*> by_key;
+        for (const auto& b : base)
+            by_key[b.key()] = &b;
+
+        std::vector<bench_change> res;
+        for (const auto& n : now) {
+            auto it = by_key.find(n.key());
+            if (it == by_key.end() || it->second->gflops <= 0)
+                continue;
+            const double ratio = n.gflops / it->second->gflops;
+            if (ratio < 1 - threshold || ratio > 1 + threshold)
+                res.push_back({*it->second, n, ratio});
+        }
+        return res;
+    }
+}
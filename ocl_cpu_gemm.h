@@ -0,0 +1,341 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define OCL_CPU_GEMM_X86 1
+#include <immintrin.h>
+#endif
+
+#include "ocl_matrix.h"
+
+namespace ocl {
+
+    // Fixed set of worker threads running parallel_for jobs; the calling thread takes part
+    struct thread_pool {
+        std::vector<std::thread> threads;
+        std::mutex mtx;
+        std::condition_variable start_cv;
+        std::condition_variable done_cv;
+        const std::function<void(size_t)>* job = NULL;
+        size_t job_size = 0;
+        std::atomic<size_t> next{0};
+        size_t generation = 0;
+        size_t active = 0;
+        bool stop = false;
+
+        thread_pool(size_t n = std::thread::hardware_concurrency()) {
+            for (size_t i = 1; i < n; ++i)
+                threads.emplace_back([this] { worker(); });
+        }
+
+        thread_pool(const thread_pool&) = delete;
+        thread_pool& operator=(const thread_pool&) = delete;
+
+        ~thread_pool() {
+            {
+                std::lock_guard<std::mutex> lk(mtx);
+                stop = true;
+            }
+            start_cv.notify_all();
+            for (auto& t : threads)
+                t.join();
+        }
+
+        size_t size() const {
+            return threads.size() + 1;
+        }
+
+        // calls fn(i) for every i in [0, n), returns when all calls are done
+        void parallel_for(size_t n, const std::function<void(size_t)>& fn) {
+            if (threads.empty() || n <= 1) {
+                for (size_t i = 0; i < n; ++i)
+                    fn(i);
+                return;
+            }
+
+            {
+                std::lock_guard<std::mutex> lk(mtx);
+                job = &fn;
+                job_size = n;
+                next = 0;
+                active = threads.size();
+                ++generation;
+            }
+            start_cv.notify_all();
+
+            work(fn, n);
+
+            std::unique_lock<std::mutex> lk(mtx);
+            done_cv.wait(lk, [this] { return active == 0; });
+            job = NULL;
+        }
+
+        void work(const std::function<void(size_t)>& fn, size_t n) {
+            for (size_t i = next.fetch_add(1); i < n; i = next.fetch_add(1))
+                fn(i);
+        }
+
+        void worker() {
+            size_t seen = 0;
+            for (;;) {
+                const std::function<void(size_t)>* fn;
+                size_t n;
+                {
+                    std::unique_lock<std::mutex> lk(mtx);
+                    start_cv.wait(lk, [&] { return stop || generation != seen; });
+                    if (stop)
+                        return;
+                    seen = generation;
+                    fn = job;
+                    n = job_size;
+                }
+
+                work(*fn, n);
+
+                std::lock_guard<std::mutex> lk(mtx);
+                if (--active == 0)
+                    done_cv.notify_one();
+            }
+        }
+    };
+
+
+    // Micro-kernels: C[MR x NR] (+)= sum over k of a[k][0..MR) x b[k][0..NR),
+    // a and b are packed panels, k-major.
+
+    struct scalar_kernel {
+        static constexpr size_t mr = 4;
+        static constexpr size_t nr = 8;
+
+        static void run(size_t kc, const float* a, const float* b, float* c, size_t ldc, bool accumulate) {
+            float acc[mr][nr] = {};
+            for (size_t k = 0; k < kc; ++k, a += mr, b += nr)
+                for (size_t i = 0; i < mr; ++i)
+                    for (size_t j = 0; j < nr; ++j)
+                        acc[i][j] += a[i] * b[j];
+
+            for (size_t i = 0; i < mr; ++i)
+                for (size_t j = 0; j < nr; ++j)
+                    c[i * ldc + j] = accumulate ? c[i * ldc + j] + acc[i][j] : acc[i][j];
+        }
+    };
+
+#ifdef OCL_CPU_GEMM_X86
+    // 6 x 16: 12 ymm accumulators, 2 for b, 1 for the broadcast a
+    struct avx2_kernel {
+        static constexpr size_t mr = 6;
+        static constexpr size_t nr = 16;
+
+        __attribute__((target("avx2,fma")))
+        static void run(size_t kc, const float* a, const float* b, float* c, size_t ldc, bool accumulate) {
+            __m256 acc[mr][2];
+            for (size_t i = 0; i < mr; ++i)
+                acc[i][0] = acc[i][1] = _mm256_setzero_ps();
+
+            for (size_t k = 0; k < kc; ++k, a += mr, b += nr) {
+                const __m256 b0 = _mm256_loadu_ps(b);
+                const __m256 b1 = _mm256_loadu_ps(b + 8);
+                for (size_t i = 0; i < mr; ++i) {
+                    const __m256 ai = _mm256_broadcast_ss(a + i);
+                    acc[i][0] = _mm256_fmadd_ps(ai, b0, acc[i][0]);
+                    acc[i][1] = _mm256_fmadd_ps(ai, b1, acc[i][1]);
+                }
+            }
+
+            for (size_t i = 0; i < mr; ++i) {
+                float* ci = c + i * ldc;
+                if (accumulate) {
+                    acc[i][0] = _mm256_add_ps(acc[i][0], _mm256_loadu_ps(ci));
+                    acc[i][1] = _mm256_add_ps(acc[i][1], _mm256_loadu_ps(ci + 8));
+                }
+                _mm256_storeu_ps(ci, acc[i][0]);
+                _mm256_storeu_ps(ci + 8, acc[i][1]);
+            }
+        }
+    };
+
+    // 8 x 32: 16 zmm accumulators
+    struct avx512_kernel {
+        static constexpr size_t mr = 8;
+        static constexpr size_t nr = 32;
+
+        __attribute__((target("avx512f")))
+        static void run(size_t kc, const float* a, const float* b, float* c, size_t ldc, bool accumulate) {
+            __m512 acc[mr][2];
+            for (size_t i = 0; i < mr; ++i)
+                acc[i][0] = acc[i][1] = _mm512_setzero_ps();
+
+            for (size_t k = 0; k < kc; ++k, a += mr, b += nr) {
+                const __m512 b0 = _mm512_loadu_ps(b);
+                const __m512 b1 = _mm512_loadu_ps(b + 16);
+                for (size_t i = 0; i < mr; ++i) {
+                    const __m512 ai = _mm512_set1_ps(a[i]);
+                    acc[i][0] = _mm512_fmadd_ps(ai, b0, acc[i][0]);
+                    acc[i][1] = _mm512_fmadd_ps(ai, b1, acc[i][1]);
+                }
+            }
+
+            for (size_t i = 0; i < mr; ++i) {
+                float* ci = c + i * ldc;
+                if (accumulate) {
+                    acc[i][0] = _mm512_add_ps(acc[i][0], _mm512_loadu_ps(ci));
+                    acc[i][1] = _mm512_add_ps(acc[i][1], _mm512_loadu_ps(ci + 16));
+                }
+                _mm512_storeu_ps(ci, acc[i][0]);
+                _mm512_storeu_ps(ci + 16, acc[i][1]);
+            }
+        }
+    };
+#endif
+
+
+    // Host C = A * Bt^T with the same interface as the OpenCL path (see multi_device_gemm::run).
+    //
+    // Goto-style blocking: a KC x NC panel of Bt is packed once per (jc, pc) block and
+    // stays in L3, every task packs an MC x KC block of A which stays in L2, and the
+    // micro-kernel streams a KC x NR sliver of the B panel through L1. The micro-kernel is
+    // picked at run time: AVX-512, AVX2+FMA or portable scalar code.
+    struct cpu_gemm {
+        enum isa_type { scalar, avx2, avx512 };
+
+        static constexpr size_t KC = 256;
+        static constexpr size_t MC = 96;
+        static constexpr size_t NC = 4096;
+
+        thread_pool pool;
+        isa_type isa;
+        std::vector<float, aligned_allocator<float>> packed_b;
+
+        cpu_gemm(size_t threads = std::thread::hardware_concurrency()) : pool(std::max<size_t>(threads, 1)), isa(detect()) {}
+
+        static isa_type detect() {
+#ifdef OCL_CPU_GEMM_X86
+            __builtin_cpu_init();
+            if (__builtin_cpu_supports("avx512f"))
+                return avx512;
+            if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+                return avx2;
+#endif
+            return scalar;
+        }
+
+        const char* isa_name() const {
+            switch (isa) {
+            case avx512: return "avx512";
+            case avx2: return "avx2";
+            default: return "scalar";
+            }
+        }
+
+        // a is M x K, bt is N x K, c is M x N
+        void run(matrix_view<const float> a, matrix_view<const float> bt, matrix_view<float> c) {
+            if (a.cols != bt.cols || c.rows != a.rows || c.cols != bt.rows)
+                throw std::invalid_argument("cpu_gemm::run: matrix sizes do not match");
+
+            if (a.cols == 0) {
+                for (size_t i = 0; i < c.rows; ++i)
+                    std::fill(c[i], c[i] + c.cols, 0.0f);
+                return;
+            }
+            // an empty C, nothing to compute
+            if (a.rows == 0 || bt.rows == 0)
+                return;
+
+#ifdef OCL_CPU_GEMM_X86
+            if (isa == avx512)
+                return blocked<avx512_kernel>(a, bt, c);
+            if (isa == avx2)
+                return blocked<avx2_kernel>(a, bt, c);
+#endif
+            blocked<scalar_kernel>(a, bt, c);
+        }
+
+        // rows [row0, row0 + rows) x columns [k0, k0 + kc) of src into R-row panels, k-major,
+        // zero-padding the last panel
+        template<size_t R>
+        static void pack(matrix_view<const float> src, size_t row0, size_t rows, size_t k0, size_t kc, float* dst) {
+            for (size_t r = 0; r < rows; r += R, dst += R * kc) {
+                const size_t n = std::min(R, rows - r);
+                for (size_t i = 0; i < n; ++i) {
+                    const float* s = src[row0 + r + i] + k0;
+                    for (size_t k = 0; k < kc; ++k)
+                        dst[k * R + i] = s[k];
+                }
+                for (size_t i = n; i < R; ++i)
+                    for (size_t k = 0; k < kc; ++k)
+                        dst[k * R + i] = 0;
+            }
+        }
+
+        template<typename Kernel>
+        void blocked(matrix_view<const float> a, matrix_view<const float> bt, matrix_view<float> c) {
+            constexpr size_t MR = Kernel::mr;
+            constexpr size_t NR = Kernel::nr;
+            constexpr size_t mc_max = (MC + MR - 1) / MR * MR;
+
+            const size_t M = a.rows;
+            const size_t N = bt.rows;
+            const size_t K = a.cols;
+            const size_t m_blocks = (M + mc_max - 1) / mc_max;
+
+            for (size_t jc = 0; jc < N; jc += NC) {
+                const size_t nc = std::min(NC, N - jc);
+                const size_t panels = (nc + NR - 1) / NR;
+
+                for (size_t pc = 0; pc < K; pc += KC) {
+                    const size_t kc = std::min(KC, K - pc);
+
+                    packed_b.resize(panels * kc * NR);
+                    pool.parallel_for(panels, [&](size_t p) {
+                        pack<NR>(bt, jc + p * NR, std::min(NR, nc - p * NR), pc, kc, &packed_b[p * kc * NR]);
+                    });
+
+                    // split the panels too if there are fewer row blocks than threads
+                    const size_t n_split = std::max<size_t>(1, std::min(panels, pool.size() / m_blocks));
+                    pool.parallel_for(m_blocks * n_split, [&](size_t t) {
+                        thread_local std::vector<float, aligned_allocator<float>> packed_a;
+
+                        const size_t ic = (t / n_split) * mc_max;
+                        const size_t mc = std::min(mc_max, M - ic);
+                        const size_t p0 = (t % n_split) * panels / n_split;
+                        const size_t p1 = (t % n_split + 1) * panels / n_split;
+
+                        packed_a.resize(mc_max * kc);
+                        pack<MR>(a, ic, mc, pc, kc, packed_a.data());
+
+                        for (size_t p = p0; p < p1; ++p) {
+                            const size_t j = jc + p * NR;
+                            const size_t nr = std::min(NR, nc - p * NR);
+                            const float* pb = &packed_b[p * kc * NR];
+
+                            for (size_t ir = 0; ir < mc; ir += MR) {
+                                const size_t mr = std::min(MR, mc - ir);
+                                const float* pa = &packed_a[ir * kc];
+                                float* cp = c[ic + ir] + j;
+
+                                if (mr == MR && nr == NR) {
+                                    Kernel::run(kc, pa, pb, cp, c.ld, pc > 0);
+                                    continue;
+                                }
+
+                                alignas(64) float tmp[MR * NR];
+                                Kernel::run(kc, pa, pb, tmp, NR, false);
+                                for (size_t i = 0; i < mr; ++i)
+                                    for (size_t jj = 0; jj < nr; ++jj)
+                                        cp[i * c.ld + jj] = (pc > 0 ? cp[i * c.ld + jj] : 0.0f) + tmp[i * NR + jj];
+                            }
+                        }
+                    });
+                }
+            }
+        }
+    };
+}
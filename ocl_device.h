@@ -1,12 +1,15 @@
 #pragma once
 
+#include <cstdio>
 #include <ostream>
+#include <sstream>
 #include <vector>
 #include <string>
 #include <algorithm>
 #include <CL/cl.h>        
 
 #include "ocl_error.h"
+#include "ocl_trace.h"
 
 namespace ocl {
 
@@ -20,8 +23,121 @@ namespace ocl {
         cl_device_local_mem_type local_memory_type;
         cl_ulong local_memory_size;
         cl_bool integrated;
+
+        std::string vendor;
+        std::string version;            // CL_DEVICE_VERSION, "OpenCL <major>.<minor> <vendor info>"
+        std::string c_version;          // CL_DEVICE_OPENCL_C_VERSION
+        std::string extensions;         // space separated
+        int version_major = 0;
+        int version_minor = 0;
+        cl_ulong global_memory_size = 0;
+        cl_ulong max_alloc = 0;
+        cl_ulong global_cache_size = 0;
+        cl_uint global_cache_line = 0;
+        cl_uint clock_mhz = 0;
+        cl_uint preferred_vector_float = 0;
+        cl_uint preferred_vector_double = 0;
+        cl_uint preferred_vector_half = 0;
+        cl_uint native_vector_float = 0;
+        cl_uint native_vector_double = 0;
+        cl_uint native_vector_half = 0;
+
+        bool has_extension(const std::string& ext) const {
+            std::istringstream s(extensions);
+            std::string e;
+            while (s >> e)
+                if (e == ext)
+                    return true;
+            return false;
+        }
+
+        bool fp64() const {
+            return dfp != 0;
+        }
+
+        bool fp16() const {
+            return has_extension("cl_khr_fp16");
+        }
+
+        bool host_unified() const {
+            return integrated == CL_TRUE || (type & CL_DEVICE_TYPE_CPU);
+        }
+
+        // Rough peak single precision GFLOPS: units x clock x lanes per unit x 2 (fma).
+        // OpenCL does not report lanes: a CPU unit is a core with native_vector_float lanes,
+        // a GPU unit is taken as 64 lanes (AMD CU, half an NVIDIA SM), or 8 for integrated
+        // GPUs reporting many small units (Intel EUs).
+        double estimated_gflops() const {
+            double lanes = 1;
+            if (type & CL_DEVICE_TYPE_GPU)
+                lanes = (integrated == CL_TRUE && units > 32) ? 8 : 64;
+            else
+                lanes = std::max<cl_uint>(native_vector_float, 1);
+            return units * (clock_mhz / 1000.0) * lanes * 2;
+        }
+
+        // Double precision throughput relative to single: the vector width ratio on CPUs,
+        // 1/16 on GPUs, where most parts are consumer ones
+        double double_ratio() const {
+            if (!fp64())
+                return 0;
+            if (type & CL_DEVICE_TYPE_GPU)
+                return 1.0 / 16;
+            return double(std::max<cl_uint>(native_vector_double, 1)) / std::max<cl_uint>(native_vector_float, 1);
+        }
+
+        // Rough bandwidth in GB/s for data in device memory, or for data which starts and ends
+        // on the host: a discrete device has to move it over the bus first
+        double estimated_bandwidth(bool host_data) const {
+            if (host_unified())
+                return 30;
+            return host_data ? 12 : 300;
+        }
+    };
+
+
+    // What a workload needs from a device, see score() and select_device()
+    struct workload_profile {
+        double flops_per_byte;          // arithmetic intensity
+        bool double_precision = false;
+        bool host_data = true;          // inputs come from and results go to host memory
+        cl_ulong memory = 0;            // bytes on the device at once, 0 if unknown
+        cl_ulong max_buffer = 0;        // largest single buffer, 0 if unknown
+
+        workload_profile(double flops_per_byte = 16) : flops_per_byte(flops_per_byte) {}
+
+        // element-wise kernels, reductions, sparse products
+        static workload_profile memory_bound() {
+            return workload_profile(0.25);
+        }
+
+        // dense products, convolutions
+        static workload_profile compute_bound() {
+            return workload_profile(64);
+        }
+
+        static workload_profile double_precision_compute() {
+            workload_profile w(64);
+            w.double_precision = true;
+            return w;
+        }
     };
 
+
+    // Estimated attainable GFLOPS of the workload on the device (roofline:
+    // min(peak, bandwidth x intensity)), 0 if the device cannot run it at all
+    double score(const device_description& dd, const workload_profile& w) {
+        if (w.double_precision && !dd.fp64())
+            return 0;
+        if (w.memory > dd.global_memory_size || w.max_buffer > dd.max_alloc)
+            return 0;
+
+        double peak = dd.estimated_gflops();
+        if (w.double_precision)
+            peak *= dd.double_ratio();
+        return std::min(peak, dd.estimated_bandwidth(w.host_data) * w.flops_per_byte);
+    }
+
     bool operator<(const device_description& x, const device_description& y) {
         if ((x.type & CL_DEVICE_TYPE_CPU) && (y.type & CL_DEVICE_TYPE_CPU)) {
             return x.units < y.units;
@@ -69,6 +185,15 @@ namespace ocl {
 
         str << "), local_memory_size=" << dd.local_memory_size; 
 
+        str << ", global_memory_size=" << dd.global_memory_size << ", max_alloc=" << dd.max_alloc
+            << ", global_cache=" << dd.global_cache_size << " (line " << dd.global_cache_line << ")"
+            << ", clock=" << dd.clock_mhz << "MHz"
+            << ", vector float/double/half=" << dd.preferred_vector_float << "/" << dd.preferred_vector_double
+            << "/" << dd.preferred_vector_half << " (native " << dd.native_vector_float << "/"
+            << dd.native_vector_double << "/" << dd.native_vector_half << ")"
+            << ", fp16=" << dd.fp16() << ", fp64=" << dd.fp64()
+            << ", " << dd.version << ", ~" << dd.estimated_gflops() << " GFLOPS";
+
         return str;
     }
 
@@ -101,6 +226,38 @@ namespace ocl {
         return v;
     }
 
+    device_description describe_device(cl_device_id did) {
+        device_description dd;
+        dd.id = did;
+        dd.name = get_device_data<std::string>(did, CL_DEVICE_NAME);
+        dd.units = get_device_data<cl_uint>(did, CL_DEVICE_MAX_COMPUTE_UNITS);
+        dd.type = get_device_data<cl_device_type>(did, CL_DEVICE_TYPE);
+        dd.dfp = get_device_data<cl_device_fp_config>(did, CL_DEVICE_DOUBLE_FP_CONFIG);
+        dd.max_work_group = get_device_data<size_t>(did, CL_DEVICE_MAX_WORK_GROUP_SIZE);
+        dd.local_memory_type = get_device_data<cl_device_local_mem_type>(did, CL_DEVICE_LOCAL_MEM_TYPE);
+        dd.local_memory_size = get_device_data<cl_ulong>(did, CL_DEVICE_LOCAL_MEM_SIZE);
+        dd.integrated = get_device_data<cl_bool>(did, CL_DEVICE_HOST_UNIFIED_MEMORY);
+
+        dd.vendor = get_device_data<std::string>(did, CL_DEVICE_VENDOR);
+        dd.version = get_device_data<std::string>(did, CL_DEVICE_VERSION);
+        dd.c_version = get_device_data<std::string>(did, CL_DEVICE_OPENCL_C_VERSION);
+        dd.extensions = get_device_data<std::string>(did, CL_DEVICE_EXTENSIONS);
+        std::sscanf(dd.version.c_str(), "OpenCL %d.%d", &dd.version_major, &dd.version_minor);
+        dd.global_memory_size = get_device_data<cl_ulong>(did, CL_DEVICE_GLOBAL_MEM_SIZE);
+        dd.max_alloc = get_device_data<cl_ulong>(did, CL_DEVICE_MAX_MEM_ALLOC_SIZE);
+        dd.global_cache_size = get_device_data<cl_ulong>(did, CL_DEVICE_GLOBAL_MEM_CACHE_SIZE);
+        dd.global_cache_line = get_device_data<cl_uint>(did, CL_DEVICE_GLOBAL_MEM_CACHELINE_SIZE);
+        dd.clock_mhz = get_device_data<cl_uint>(did, CL_DEVICE_MAX_CLOCK_FREQUENCY);
+        dd.preferred_vector_float = get_device_data<cl_uint>(did, CL_DEVICE_PREFERRED_VECTOR_WIDTH_FLOAT);
+        dd.preferred_vector_double = get_device_data<cl_uint>(did, CL_DEVICE_PREFERRED_VECTOR_WIDTH_DOUBLE);
+        dd.preferred_vector_half = get_device_data<cl_uint>(did, CL_DEVICE_PREFERRED_VECTOR_WIDTH_HALF);
+        dd.native_vector_float = get_device_data<cl_uint>(did, CL_DEVICE_NATIVE_VECTOR_WIDTH_FLOAT);
+        dd.native_vector_double = get_device_data<cl_uint>(did, CL_DEVICE_NATIVE_VECTOR_WIDTH_DOUBLE);
+        dd.native_vector_half = get_device_data<cl_uint>(did, CL_DEVICE_NATIVE_VECTOR_WIDTH_HALF);
+        return dd;
+    }
+
+
     auto get_devices(cl_platform_id pid) {
         std::vector<device_description> res;
 
@@ -113,25 +270,15 @@ namespace ocl {
         std::vector<cl_device_id> devices(count);
         clGetDeviceIDs(pid, CL_DEVICE_TYPE_ALL, count, &devices[0], NULL);
 
-        for (const auto& did : devices) {
-            device_description dd;
-            dd.id = did;
-            dd.name = get_device_data<std::string>(did, CL_DEVICE_NAME);
-            dd.units = get_device_data<cl_uint>(did, CL_DEVICE_MAX_COMPUTE_UNITS);
-            dd.type = get_device_data<cl_device_type>(did, CL_DEVICE_TYPE);
-            dd.dfp = get_device_data<cl_device_fp_config>(did, CL_DEVICE_DOUBLE_FP_CONFIG);
-            dd.max_work_group = get_device_data<size_t>(did, CL_DEVICE_MAX_WORK_GROUP_SIZE);
-            dd.local_memory_type = get_device_data<cl_device_local_mem_type>(did, CL_DEVICE_LOCAL_MEM_TYPE);
-            dd.local_memory_size = get_device_data<cl_ulong>(did, CL_DEVICE_LOCAL_MEM_SIZE);
-            dd.integrated = get_device_data<cl_bool>(did, CL_DEVICE_HOST_UNIFIED_MEMORY);
-            res.push_back(dd);
-        }
+        for (const auto& did : devices)
+            res.push_back(describe_device(did));
 
         return res; 
     }
 
 
-    auto get_devices() {
+    std::vector<device_description> query_devices() {
+        OCL_TRACE_SPAN("query_devices");
         cl_uint count;     
         auto ret = clGetPlatformIDs(0, NULL, &count);
         if (ret != CL_SUCCESS)
@@ -150,4 +297,31 @@ namespace ocl {
         std::sort(res.begin(), res.end(), [](auto x, auto y) {return y < x;});
         return res;
     }
+
+
+    // All devices of all platforms, queried once per process
+    auto get_devices() {
+        static const auto all = query_devices();
+        return all;
+    }
+
+
+    // Usable device with the best score() for the workload
+    const device_description& select_device(const std::vector<device_description>& devices, const workload_profile& w) {
+        const device_description* best = NULL;
+        double best_score = 0;
+        for (const auto& dd : devices) {
+            const double s = score(dd, w);
+            if (s > best_score) {
+                best = &dd;
+                best_score = s;
+            }
+        }
+        if (best == NULL) {
+            clexception e(CL_DEVICE_NOT_FOUND);
+            e << "select_device: no device can run the workload";
+            throw e;
+        }
+        return *best;
+    }
 }
@@ -132,6 +132,11 @@ namespace ocl {
             copy = text.str();
         }
 
+        // for std::exception_ptr, which copies the exception
+        clexception(const clexception& x) : copy(x.copy), ret(x.ret) {
+            text << x.copy;
+        }
+
         const char* what() const noexcept override {
             return copy.c_str();
         }
@@ -0,0 +1,518 @@
+#pragma once
+#include <memory>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <CL/cl.h>
+
+#include "ocl_error.h"
+#include "ocl_device.h"
+#include "ocl_helpers.h"
+#include "ocl_autotune.h"
+#include "ocl_specialize.h"
+#include "ocl_precision.h"
+
+namespace ocl {
+
+    // C = A * Bt^T, where A is M x K, Bt is N x K (B already transposed) and C is M x N,
+    // all row-major and densely packed.
+    //
+    // Each work-group computes a TS_M x TS_N tile of C. Tiles of A and Bt are staged
+    // through local memory TS_K columns at a time, and every work-item accumulates
+    // WPT_M x WPT_N outputs in registers. Loads along K use VW-wide vectors where the
+    // whole vector is inside the matrix and fall back to guarded scalar loads at the
+    // edges, so any M, N, K work.
+    //
+    // Work-group shape is (TS_N / WPT_N, TS_M / WPT_M): dimension 0 runs along the
+    // columns of C, so neighbouring work-items store to neighbouring addresses.
+    //
+    // SPEC_M, SPEC_N and SPEC_K, if defined (all three), replace the M, N, K arguments,
+    // which must then be equal to them; when the shape is a multiple of the tiles the
+    // edge guards are compiled out. See specialization_cache.
+    //
+    // STORAGE and ACC (16, 32 or 64 bits, float by default) are the element type of A, Bt
+    // and C and the type of the local tiles and accumulators.
+    const char* sgemm_kernel_code = R"(
+#ifndef TS_M
+#define TS_M 32
+#endif
+#ifndef TS_N
+#define TS_N 32
+#endif
+#ifndef TS_K
+#define TS_K 16
+#endif
+#ifndef WPT_M
+#define WPT_M 4
+#endif
+#ifndef WPT_N
+#define WPT_N 4
+#endif
+#ifndef VW
+#define VW 4
+#endif
+
+// the guards are always true for tile-aligned specializations (TS_K is a multiple of VW)
+#if defined(SPEC_M) && defined(SPEC_N) && SPEC_M % TS_M == 0 && SPEC_N % TS_N == 0
+#define IN_ROWS(x) 1
+#else
+#define IN_ROWS(x) (x)
+#endif
+#if defined(SPEC_K) && SPEC_K % TS_K == 0
+#define IN_K(x) 1
+#else
+#define IN_K(x) (x)
+#endif
+
+#define RTS_M (TS_M / WPT_M)
+#define RTS_N (TS_N / WPT_N)
+#define THREADS (RTS_M * RTS_N)
+#define PAD 1
+
+#ifndef STORAGE
+#define STORAGE 32
+#endif
+#ifndef ACC
+#define ACC 32
+#endif
+
+#if STORAGE == 64 || ACC == 64
+#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+#endif
+#if ACC == 16
+#pragma OPENCL EXTENSION cl_khr_fp16 : enable
+#endif
+
+#define CAT_(a, b) a##b
+#define CAT(a, b) CAT_(a, b)
+
+// real: local tiles and accumulators
+#if ACC == 64
+#define real double
+#elif ACC == 16
+#define real half
+#else
+#define real float
+#endif
+#define realV CAT(real, VW)
+
+// storage: A, Bt and C; half goes through vload_half/vstore_half, which are core functions
+#if STORAGE == 16
+#define storage half
+#define LOAD(p, i) vload_half(i, p)
+#define LOADV(p) CAT(vload_half, VW)(0, p)
+#define STORE(x, p, i) vstore_half((float)(x), i, p)
+#else
+#if STORAGE == 64
+#define storage double
+#else
+#define storage float
+#endif
+#define LOAD(p, i) (p)[i]
+#define LOADV(p) CAT(vload, VW)(0, p)
+#define STORE(x, p, i) (p)[i] = (storage)(x)
+#endif
+
+// Copies rows [row0, row0 + tile_rows) x columns [k0, k0 + TS_K) of a row-major
+// rows x K matrix into a k-major local tile, zero-filling everything outside the matrix.
+void load_tile(__local real* tile, const int tile_rows, __global const storage* src,
+               const int rows, const int depth, const int row0, const int k0, const int tid)
+{
+    for (int l = tid; l < tile_rows * (TS_K / VW); l += THREADS) {
+        const int r = l / (TS_K / VW);
+        const int c = (l % (TS_K / VW)) * VW;
+        const int gr = row0 + r;
+        const int gc = k0 + c;
+
+        real v[VW];
+#if VW > 1
+        if (IN_ROWS(gr < rows) && IN_K(gc + VW <= depth)) {
+            CAT(vstore, VW)(CAT(convert_, realV)(LOADV(src + (size_t)gr * depth + gc)), 0, v);
+        }
+        else
+#endif
+        {
+            #pragma unroll
+            for (int i = 0; i < VW; ++i)
+                v[i] = (IN_ROWS(gr < rows) && IN_K(gc + i < depth)) ? (real)LOAD(src, (size_t)gr * depth + gc + i) : (real)0;
+        }
+
+        #pragma unroll
+        for (int i = 0; i < VW; ++i)
+            tile[(c + i) * (tile_rows + PAD) + r] = v[i];
+    }
+}
+
+// One TS_M x TS_N tile of C, selected by the group ids in dimensions 0 and 1
+void gemm_tile(__local real* As, __local real* Bs, const int M, const int N, const int K,
+               __global const storage *A, __global const storage *Bt, __global storage *C)
+{
+    const int tn = get_local_id(0);
+    const int tm = get_local_id(1);
+    const int tid = tm * RTS_N + tn;
+    const int col0 = get_group_id(0) * TS_N;
+    const int row0 = get_group_id(1) * TS_M;
+
+    real acc[WPT_M][WPT_N];
+    for (int wm = 0; wm < WPT_M; ++wm)
+        for (int wn = 0; wn < WPT_N; ++wn)
+            acc[wm][wn] = (real)0;
+
+    for (int k0 = 0; k0 < K; k0 += TS_K) {
+        load_tile(As, TS_M, A, M, K, row0, k0, tid);
+        load_tile(Bs, TS_N, Bt, N, K, col0, k0, tid);
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        #pragma unroll
+        for (int k = 0; k < TS_K; ++k) {
+            real a[WPT_M];
+            real b[WPT_N];
+            #pragma unroll
+            for (int wm = 0; wm < WPT_M; ++wm)
+                a[wm] = As[k * (TS_M + PAD) + tm + wm * RTS_M];
+            #pragma unroll
+            for (int wn = 0; wn < WPT_N; ++wn)
+                b[wn] = Bs[k * (TS_N + PAD) + tn + wn * RTS_N];
+
+            #pragma unroll
+            for (int wm = 0; wm < WPT_M; ++wm) {
+                #pragma unroll
+                for (int wn = 0; wn < WPT_N; ++wn)
+                    acc[wm][wn] += a[wm] * b[wn];
+            }
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    for (int wm = 0; wm < WPT_M; ++wm) {
+        const int r = row0 + tm + wm * RTS_M;
+        for (int wn = 0; wn < WPT_N; ++wn) {
+            const int c = col0 + tn + wn * RTS_N;
+            if (IN_ROWS(r < M && c < N))
+                STORE(acc[wm][wn], C, (size_t)r * N + c);
+        }
+    }
+}
+
+#ifdef SPEC_M
+#define GEMM_SHAPE const int M = SPEC_M, N = SPEC_N, K = SPEC_K
+#else
+#define GEMM_SHAPE const int M = M_arg, N = N_arg, K = K_arg
+#endif
+
+__kernel __attribute__((reqd_work_group_size(RTS_N, RTS_M, 1)))
+void sgemm_nt(int M_arg, int N_arg, int K_arg, __global const storage *A, __global const storage *Bt, __global storage *C)
+{
+    __local real As[TS_K * (TS_M + PAD)];
+    __local real Bs[TS_K * (TS_N + PAD)];
+    GEMM_SHAPE;
+
+    gemm_tile(As, Bs, M, N, K, A, Bt, C);
+}
+
+// Batch of independent products, dimension 2 is the index in the batch. Matrix b starts
+// at element offsets[3 * b], offsets[3 * b + 1], offsets[3 * b + 2] of A, Bt, C if the
+// offset table is given, at b * stride_a, b * stride_b, b * stride_c otherwise.
+__kernel __attribute__((reqd_work_group_size(RTS_N, RTS_M, 1)))
+void sgemm_nt_batched(int M_arg, int N_arg, int K_arg, __global const storage *A, __global const storage *Bt, __global storage *C,
+                      long stride_a, long stride_b, long stride_c, __global const ulong *offsets)
+{
+    __local real As[TS_K * (TS_M + PAD)];
+    __local real Bs[TS_K * (TS_N + PAD)];
+    GEMM_SHAPE;
+
+    const size_t b = get_global_id(2);
+    if (offsets != 0) {
+        A += offsets[3 * b];
+        Bt += offsets[3 * b + 1];
+        C += offsets[3 * b + 2];
+    }
+    else {
+        A += b * stride_a;
+        Bt += b * stride_b;
+        C += b * stride_c;
+    }
+
+    gemm_tile(As, Bs, M, N, K, A, Bt, C);
+}
+)";
+
+
+    // Compile-time parameters of sgemm_kernel_code
+    struct gemm_config {
+        size_t tile_m;          // rows of C per work-group
+        size_t tile_n;          // columns of C per work-group
+        size_t tile_k;          // depth of the local memory tiles
+        size_t wpt_m;           // rows of C per work-item
+        size_t wpt_n;           // columns of C per work-item
+        size_t vector_width;    // width of the loads along K: 1, 2, 4 or 8
+
+        size_t local_m() const { return tile_m / wpt_m; }
+        size_t local_n() const { return tile_n / wpt_n; }
+        size_t work_group_size() const { return local_m() * local_n(); }
+
+        size_t local_memory(size_t item_size = sizeof(cl_float)) const {
+            // both tiles are padded by one element per k-row, see PAD in the kernel
+            return tile_k * (tile_m + 1 + tile_n + 1) * item_size;
+        }
+
+        size_t groups(size_t M, size_t N) const {
+            return ((M + tile_m - 1) / tile_m) * ((N + tile_n - 1) / tile_n);
+        }
+
+        std::string options() const {
+            std::stringstream s;
+            s << "-DTS_M=" << tile_m << " -DTS_N=" << tile_n << " -DTS_K=" << tile_k
+              << " -DWPT_M=" << wpt_m << " -DWPT_N=" << wpt_n << " -DVW=" << vector_width;
+            return s.str();
+        }
+    };
+
+
+    std::ostream& operator<<(std::ostream& str, const gemm_config& c) {
+        str << "tile=" << c.tile_m << "x" << c.tile_n << "x" << c.tile_k
+            << ", per item=" << c.wpt_m << "x" << c.wpt_n
+            << ", vector=" << c.vector_width
+            << ", work group=" << c.local_n() << "x" << c.local_m();
+        return str;
+    }
+
+
+    // All known configurations, the most register and local memory hungry first
+    std::vector<gemm_config> gemm_configs() {
+        return {
+            {128, 128, 16, 8, 8, 8},
+            {64, 64, 16, 4, 4, 4},
+            {64, 64, 16, 8, 8, 8},
+            {32, 32, 16, 4, 4, 4},
+            {32, 32, 8, 2, 2, 4},
+            {16, 16, 8, 2, 2, 4},
+            {16, 16, 8, 4, 4, 4},
+            {8, 8, 8, 2, 2, 4},
+            {4, 4, 4, 1, 1, 4},
+            {4, 4, 4, 4, 4, 4},
+        };
+    }
+
+
+    // Configurations which fit the device limits, in order of preference.
+    // If the problem size is known, configurations which leave some compute units
+    // without a work-group go to the end of the list, and after them those whose tile
+    // is at least twice the matrix, so most of the work-group would idle.
+    // batch is the number of products run in one launch (see gemm::run_batched), item_size
+    // the size of the accumulator type the local memory tiles are made of.
+    std::vector<gemm_config> gemm_configs(const device_description& dd, size_t M = 0, size_t N = 0, size_t batch = 1,
+                                          size_t item_size = sizeof(cl_float)) {
+        std::vector<gemm_config> res;
+        std::vector<gemm_config> small;
+        std::vector<gemm_config> oversized;
+
+        const bool cpu = (dd.type & CL_DEVICE_TYPE_CPU) || dd.local_memory_type != CL_LOCAL;
+
+        for (const auto& c : gemm_configs()) {
+            if (c.work_group_size() > dd.max_work_group || c.local_memory(item_size) > dd.local_memory_size)
+                continue;
+            // CPU runtimes execute a work-group as a loop over work-items, so big
+            // work-groups only add barrier overhead there
+            if (cpu && c.work_group_size() > 64)
+                continue;
+            if (M != 0 && N != 0 && (c.tile_m >= 2 * M || c.tile_n >= 2 * N))
+                oversized.push_back(c);
+            else if (M != 0 && N != 0 && c.groups(M, N) * batch < dd.units)
+                small.push_back(c);
+            else
+                res.push_back(c);
+        }
+
+        res.insert(res.end(), small.begin(), small.end());
+        res.insert(res.end(), oversized.begin(), oversized.end());
+        return res;
+    }
+
+
+    std::vector<size_t> gemm_shape(size_t M, size_t N, size_t K) {
+        return {M, N, K};
+    }
+
+
+    // Configuration stored for the device and shape bucket by tune_sgemm
+    bool find_tuned_gemm(const tuning_table& table, const device_description& dd, size_t M, size_t N, size_t K, gemm_config* cfg) {
+        auto t = table.find(dd.name, "sgemm_nt", gemm_shape(M, N, K));
+        if (t == NULL)
+            return false;
+        for (const auto& c : gemm_configs()) {
+            if (c.options() == t->options) {
+                *cfg = c;
+                return true;
+            }
+        }
+        return false;
+    }
+
+
+    // Tiled multiplication, built for one device. Storage is the element type of A, Bt and C
+    // (half, cl_float or cl_double), Acc the type products are summed in; half storage is
+    // converted with vload_half/vstore_half, so it works on any device, double needs fp64
+    // and half accumulation cl_khr_fp16.
+    template<typename Storage, typename Acc = typename precision<Storage>::accumulator>
+    struct gemm {
+        gemm_config cfg;
+        std::unique_ptr<program> p;
+        kernel* k = NULL;   // owned by p
+        std::string options;
+        specialization_cache* jit = NULL;   // if set, run() takes shape-specialized variants from it
+
+        static constexpr bool single = precision<Storage>::bits == 32 && precision<Acc>::bits == 32;
+
+        // Takes the configuration tuned for the shape if the table has one (the table is
+        // filled by tune_sgemm, so only for single precision), otherwise the first
+        // configuration from gemm_configs(dd, M, N) the compiled kernel can run
+        gemm(context& ctx, const device_description& dd, size_t M = 0, size_t N = 0, size_t K = 0,
+             const tuning_table* tuning = NULL, size_t batch = 1) {
+            check_device(dd);
+            gemm_config tuned;
+            if (single && tuning != NULL && find_tuned_gemm(*tuning, dd, M, N, K, &tuned)) {
+                build(ctx, tuned);
+                if (batch <= 1 || fits(ctx, tuned, batch))
+                    return;
+            }
+            for (const auto& c : gemm_configs(dd, M, N, batch, sizeof(Acc))) {
+                build(ctx, c);
+                if (fits(ctx, c, batch))
+                    return;
+            }
+            clexception e(CL_INVALID_WORK_GROUP_SIZE);
+            e << "gemm: no configuration fits device " << dd.name;
+            throw e;
+        }
+
+        // the built kernels can run c's work-group size; with batch > 1 run_batched launches
+        // sgemm_nt_batched, whose limit may be lower than that of sgemm_nt
+        bool fits(context& ctx, const gemm_config& c, size_t batch) {
+            if (k->work_group_size(ctx.did) < c.work_group_size())
+                return false;
+            return batch <= 1 || p->get_kernel("sgemm_nt_batched").work_group_size(ctx.did) >= c.work_group_size();
+        }
+
+        // c as given; refused like the configurations the other constructor goes through
+        // if the compiled kernel cannot run its work-group size
+        gemm(context& ctx, const gemm_config& c) {
+            if (!single)
+                check_device(describe_device(ctx.did));
+            build(ctx, c);
+            if (!fits(ctx, c, 1)) {
+                clexception e(CL_INVALID_WORK_GROUP_SIZE);
+                e << "gemm: configuration " << c.options() << " needs " << c.work_group_size()
+                  << " work-items per group, the kernel runs at most " << k->work_group_size(ctx.did);
+                throw e;
+            }
+        }
+
+        // the build would fail anyway, but with a compiler log instead of the reason
+        static void check_device(const device_description& dd) {
+            const bool fp64 = precision<Storage>::bits == 64 || precision<Acc>::bits == 64;
+            const bool fp16 = precision<Acc>::bits == 16;
+            if ((fp64 && !dd.fp64()) || (fp16 && !dd.fp16())) {
+                clexception e(CL_INVALID_DEVICE);
+                e << "gemm: " << dd.name << " has no " << (fp64 ? "double" : "half") << " precision support";
+                throw e;
+            }
+        }
+
+        // empty for float, so single precision keeps its program cache and tuning entries
+        static std::string precision_options() {
+            if (single)
+                return "";
+            return " -DSTORAGE=" + std::to_string(precision<Storage>::bits) + " -DACC=" + std::to_string(precision<Acc>::bits);
+        }
+
+        void build(context& ctx, const gemm_config& c) {
+            k = NULL;
+            cfg = c;
+            options = cfg.options() + precision_options();
+            p = std::make_unique<program>(ctx.create_program(sgemm_kernel_code, options.c_str()));
+            k = &p->get_kernel("sgemm_nt");
+        }
+
+        // a is M x K, bt is N x K, c is M x N
+        void run(command_queue& q, int M, int N, int K, cl_mem a, cl_mem bt, cl_mem c) {
+            pick("sgemm_nt", M, N, K)(q, range(M, N, 1), M, N, K, a, bt, c);
+        }
+
+        // batch products in one launch, product i on the matrices starting i * stride_a,
+        // i * stride_b and i * stride_c elements into a, bt and c
+        void run_batched(command_queue& q, int M, int N, int K, size_t batch,
+                         cl_mem a, size_t stride_a, cl_mem bt, size_t stride_b, cl_mem c, size_t stride_c) {
+            if (batch == 0)
+                return;
+            const cl_mem no_offsets = NULL;
+            pick("sgemm_nt_batched", M, N, K)(q, range(M, N, batch), M, N, K, a, bt, c,
+                cl_long(stride_a), cl_long(stride_b), cl_long(stride_c), no_offsets);
+        }
+
+        // batch products in one launch; offsets holds batch x 3 cl_ulong element offsets
+        // of the matrices of every product in a, bt and c
+        void run_batched(command_queue& q, int M, int N, int K, size_t batch, cl_mem a, cl_mem bt, cl_mem c, cl_mem offsets) {
+            if (batch == 0)
+                return;
+            pick("sgemm_nt_batched", M, N, K)(q, range(M, N, batch), M, N, K, a, bt, c,
+                cl_long(0), cl_long(0), cl_long(0), offsets);
+        }
+
+        // a work-group per tile of C, dimension 2 runs over the batch
+        nd_range range(int M, int N, size_t batch) const {
+            const size_t groups_m = (M + cfg.tile_m - 1) / cfg.tile_m;
+            const size_t groups_n = (N + cfg.tile_n - 1) / cfg.tile_n;
+            if (batch == 1)
+                return nd_range(groups_n * cfg.local_n(), groups_m * cfg.local_m()).with_local(cfg.local_n(), cfg.local_m());
+            return nd_range(groups_n * cfg.local_n(), groups_m * cfg.local_m(), batch).with_local(cfg.local_n(), cfg.local_m(), 1);
+        }
+
+        // the shape-specialized variant if the jit cache has one, the generic kernel otherwise
+        kernel& pick(const char* name, int M, int N, int K) {
+            if (jit != NULL) {
+                const std::string spec = specialization_cache::define("SPEC_M", M)
+                    + specialization_cache::define("SPEC_N", N) + specialization_cache::define("SPEC_K", K);
+                if (kernel* s = jit->get(sgemm_kernel_code, name, options, spec))
+                    return *s;
+            }
+            return p->get_kernel(name);
+        }
+    };
+
+
+    using sgemm = gemm<cl_float>;
+    using dgemm = gemm<cl_double>;
+    using hgemm = gemm<half>;      // half storage, float accumulation
+
+
+    // Benchmarks every configuration fitting the device on an M x N x K problem,
+    // stores the fastest in the table and returns it
+    gemm_config tune_sgemm(tuning_table& table, context& ctx, command_queue& q, const device_description& dd,
+                           int M, int N, int K, std::vector<tuned_config>* measured = NULL) {
+        mem_buffer a = ctx.create_buffer(CL_MEM_READ_ONLY, size_t(M) * K * sizeof(cl_float));
+        mem_buffer bt = ctx.create_buffer(CL_MEM_READ_ONLY, size_t(N) * K * sizeof(cl_float));
+        mem_buffer c = ctx.create_buffer(CL_MEM_WRITE_ONLY, size_t(M) * N * sizeof(cl_float));
+
+        std::vector<tune_candidate> candidates;
+        for (const auto& cfg : gemm_configs(dd, M, N)) {
+            const size_t groups_m = (M + cfg.tile_m - 1) / cfg.tile_m;
+            const size_t groups_n = (N + cfg.tile_n - 1) / cfg.tile_n;
+            candidates.push_back({cfg.options(), 2,
+                {groups_n * cfg.local_n(), groups_m * cfg.local_m()},
+                {cfg.local_n(), cfg.local_m()}});
+        }
+
+        auto set_args = [&](kernel& k) {
+            k.set_args(M, N, K, a, bt, c);
+        };
+
+        tune(table, ctx, q, sgemm_kernel_code, "sgemm_nt", gemm_shape(M, N, K), candidates, set_args, 3, measured);
+
+        gemm_config res;
+        if (!find_tuned_gemm(table, dd, M, N, K, &res))
+            throw clexception("tune_sgemm", CL_INVALID_VALUE);
+        return res;
+    }
+}
@@ -0,0 +1,584 @@
+#pragma once
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <type_traits>
+#include <vector>
+#include <CL/cl.h>
+
+#include "ocl_error.h"
+#include "ocl_device.h"
+#include "ocl_helpers.h"
+
+namespace ocl {
+
+    // Value of a command_graph given at replay time, see command_graph::param
+    template<typename T>
+    struct graph_param {
+        using value_type = T;
+        size_t index;
+    };
+
+
+#ifdef cl_khr_command_buffer
+    // Entry points of cl_khr_command_buffer, all NULL if the platform does not export them
+    struct command_buffer_api {
+        clCreateCommandBufferKHR_fn create = NULL;
+        clCommandNDRangeKernelKHR_fn ndrange = NULL;
+        clFinalizeCommandBufferKHR_fn finalize = NULL;
+        clEnqueueCommandBufferKHR_fn enqueue = NULL;
+        clReleaseCommandBufferKHR_fn release = NULL;
+
+        bool loaded() const {
+            return create && ndrange && finalize && enqueue && release;
+        }
+
+        static command_buffer_api load(cl_device_id did) {
+            command_buffer_api api;
+            const auto platform = get_device_data<cl_platform_id>(did, CL_DEVICE_PLATFORM);
+            api.create = (clCreateCommandBufferKHR_fn)clGetExtensionFunctionAddressForPlatform(platform, "clCreateCommandBufferKHR");
+            api.ndrange = (clCommandNDRangeKernelKHR_fn)clGetExtensionFunctionAddressForPlatform(platform, "clCommandNDRangeKernelKHR");
+            api.finalize = (clFinalizeCommandBufferKHR_fn)clGetExtensionFunctionAddressForPlatform(platform, "clFinalizeCommandBufferKHR");
+            api.enqueue = (clEnqueueCommandBufferKHR_fn)clGetExtensionFunctionAddressForPlatform(platform, "clEnqueueCommandBufferKHR");
+            api.release = (clReleaseCommandBufferKHR_fn)clGetExtensionFunctionAddressForPlatform(platform, "clReleaseCommandBufferKHR");
+            return api;
+        }
+    };
+#endif
+
+
+    // A sequence of transfers and kernel launches recorded once and replayed many times:
+    //
+    //     command_graph g;
+    //     auto a = g.param<cl_mem>();
+    //     auto host_a = g.param<void*>();
+    //     auto n = g.param<int>();
+    //     size_t w = g.write(a, 0, bytes, host_a);
+    //     size_t k = g.launch(kern, nd_range(1024), {w}, n, a, out);
+    //     g.read(out, 0, bytes, result, {k});
+    //     for (...) {
+    //         g.set(host_a, next_input);
+    //         g.set(n, count);
+    //         g.replay(q);
+    //     }
+    //
+    // Buffers, host pointers and kernel arguments are either fixed when recorded or
+    // params set before a replay. Everything that does not change between replays is
+    // checked once: argument count and types when recorded, work-group sizes and fixed
+    // buffer sizes when the graph is prepared for a queue, param buffer sizes in set().
+    // replay() then only binds the arguments that changed (see kernel::bind) and calls
+    // the enqueue functions directly, without allocations or driver queries.
+    //
+    // Every node lists the nodes it depends on. An in-order queue runs the nodes in the
+    // order they were recorded and no events are made; on an out-of-order queue a node
+    // waits for the events of its dependencies only, and a replay starts with a barrier,
+    // so it does not overlap the previous replay or other earlier commands of the queue.
+    // Transfers are not blocking: host memory must stay valid until the queue has
+    // finished the replay.
+    //
+    // On an in-order queue of a device with cl_khr_command_buffer, runs of consecutive
+    // kernel nodes are recorded into a command buffer and enqueued with a single call.
+    // Setting a param used by such kernels records the buffer again on the next replay.
+    struct command_graph {
+        static constexpr size_t none = size_t(-1);
+
+        enum slot_kind { buffer_slot, host_slot, value_slot };
+
+        struct slot {
+            slot_kind kind;
+            size_t size;
+            std::string bytes;
+            bool set = false;
+            size_t extent = 0;          // buffers: bytes the transfers of the graph touch
+            bool in_kernel = false;     // used as a kernel argument
+        };
+
+        // a fixed value, or the value of slot
+        struct ref {
+            size_t slot = none;
+            std::string bytes;
+        };
+
+        struct kernel_arg {
+            ref value;
+            size_t size = 0;
+            bool local = false;
+        };
+
+        struct node {
+            cl_command_type type;
+            std::vector<size_t> deps;
+            std::vector<size_t> dependents;
+
+            // transfers
+            ref buffer;
+            size_t offset = 0;
+            size_t size = 0;
+            ref host;
+
+            // kernels
+            kernel* k = NULL;
+            nd_range range = nd_range(1);         // as recorded
+            nd_range run_range = nd_range(1);     // with the tuned local size of the prepared queue
+            std::vector<kernel_arg> args;
+
+            std::vector<cl_event> wait;     // events of deps during a replay
+            size_t segment = none;          // command buffer the node is recorded in
+        };
+
+        std::vector<slot> slots;
+        std::vector<node> nodes;
+        std::vector<cl_event> events;       // per node, during a replay
+        size_t unset = 0;                   // params not set yet
+        cl_command_queue prepared = NULL;   // queue the graph was prepared for
+        bool out_of_order = false;
+
+#ifdef cl_khr_command_buffer
+        struct segment {
+            size_t first;
+            size_t last;                    // one past
+            cl_command_buffer_khr cb = NULL;
+            bool dirty = true;
+        };
+
+        command_buffer_api api;
+        std::vector<segment> segments;
+#endif
+
+        command_graph() {}
+        command_graph(const command_graph&) = delete;
+        command_graph& operator=(const command_graph&) = delete;
+
+        ~command_graph() {
+            release();
+        }
+
+        template<typename T>
+        graph_param<T> param() {
+            static_assert(std::is_trivially_copyable<T>::value, "graph param must be trivially copyable");
+            slot s;
+            s.kind = std::is_same<T, cl_mem>::value ? buffer_slot : std::is_same<T, void*>::value ? host_slot : value_slot;
+            s.size = sizeof(T);
+            slots.push_back(s);
+            unset += 1;
+            return {slots.size() - 1};
+        }
+
+        template<typename T>
+        void set(graph_param<T> p, const typename graph_param<T>::value_type& value) {
+            auto& s = slots.at(p.index);
+            if (s.kind == buffer_slot && s.extent != 0) {
+                const cl_mem m = *reinterpret_cast<const cl_mem*>(&value);
+                check_size(m, s.extent);
+            }
+
+            const char* b = reinterpret_cast<const char*>(&value);
+            if (s.set && std::memcmp(s.bytes.data(), b, sizeof(T)) == 0)
+                return;
+            if (!s.set)
+                unset -= 1;
+            s.set = true;
+            s.bytes.assign(b, sizeof(T));
+#ifdef cl_khr_command_buffer
+            if (s.in_kernel)
+                for (auto& sg : segments)
+                    sg.dirty = true;
+#endif
+        }
+
+        // copies size bytes from host to buffer at offset, returns the node index
+        template<typename Buffer, typename Host>
+        size_t write(const Buffer& buffer, size_t offset, size_t size, const Host& host, const std::vector<size_t>& deps = {}) {
+            return transfer(CL_COMMAND_WRITE_BUFFER, to_ref(buffer), offset, size, to_ref(host), deps);
+        }
+
+        // copies size bytes from buffer at offset to host, returns the node index
+        template<typename Buffer, typename Host>
+        size_t read(const Buffer& buffer, size_t offset, size_t size, const Host& host, const std::vector<size_t>& deps = {}) {
+            return transfer(CL_COMMAND_READ_BUFFER, to_ref(buffer), offset, size, to_ref(host), deps);
+        }
+
+        // k over r with all its arguments, fixed values as in kernel::set_args or params;
+        // returns the node index. k must outlive the graph.
+        template<typename... Args>
+        size_t launch(kernel& k, const nd_range& r, const std::vector<size_t>& deps, const Args&... args) {
+            k.load_arg_info();
+            if (sizeof...(Args) != k.bound.size()) {
+                clexception e(CL_INVALID_KERNEL_ARGS);
+                e << "graph: kernel " << k.name << " takes " << k.bound.size() << " arguments, " << sizeof...(Args) << " given";
+                throw e;
+            }
+
+            node n;
+            n.type = CL_COMMAND_NDRANGE_KERNEL;
+            n.k = &k;
+            n.range = r;
+            cl_uint i = 0;
+            (n.args.push_back(to_arg(k, i++, args)), ...);
+            return add(std::move(n), deps);
+        }
+
+        // Checks what does not depend on params for the queue and prepares the replay on it.
+        // replay() calls it when the queue changes.
+        void prepare(command_queue& q) {
+            release();
+
+            cl_device_id did = NULL;
+            cl_int ret = clGetCommandQueueInfo(q.q, CL_QUEUE_DEVICE, sizeof(did), &did, NULL);
+            if (ret != CL_SUCCESS)
+                throw clexception("clGetCommandQueueInfo", ret);
+
+            for (auto& n : nodes) {
+                if (n.type == CL_COMMAND_NDRANGE_KERNEL)
+                    prepare_range(q, did, n);
+                else if (n.buffer.slot == none)
+                    check_size(cl_mem_of(n.buffer), n.offset + n.size);
+            }
+
+            out_of_order = q.out_of_order;
+            events.assign(nodes.size(), NULL);
+            prepared = q.q;
+
+#ifdef cl_khr_command_buffer
+            if (!out_of_order && describe_device(did).has_extension("cl_khr_command_buffer")) {
+                api = command_buffer_api::load(did);
+                if (api.loaded())
+                    make_segments();
+            }
+#endif
+        }
+
+        // enqueues the graph on q; all params must be set
+        void replay(command_queue& q) {
+            if (prepared != q.q)
+                prepare(q);
+            if (unset != 0) {
+                clexception e(CL_INVALID_VALUE);
+                e << "graph: " << unset << " params not set";
+                throw e;
+            }
+
+            // the nodes wait only on events of this replay; the previous one may still read
+            // the same buffers and write the same host memory
+            if (out_of_order) {
+                cl_int ret = clEnqueueBarrierWithWaitList(q.q, 0, NULL, NULL);
+                if (ret != CL_SUCCESS)
+                    throw clexception("clEnqueueBarrierWithWaitList", ret);
+            }
+
+            for (size_t i = 0; i < nodes.size(); ) {
+#ifdef cl_khr_command_buffer
+                if (nodes[i].segment != none) {
+                    i = run_segment(q, segments[nodes[i].segment]);
+                    continue;
+                }
+#endif
+                run_node(q, i);
+                ++i;
+            }
+
+            for (auto& e : events) {
+                if (e != NULL)
+                    clReleaseEvent(e);
+                e = NULL;
+            }
+        }
+
+        void release() {
+#ifdef cl_khr_command_buffer
+            for (auto& s : segments)
+                if (s.cb != NULL)
+                    api.release(s.cb);
+            segments.clear();
+            for (auto& n : nodes)
+                n.segment = none;
+#endif
+            prepared = NULL;
+        }
+
+        size_t add(node n, const std::vector<size_t>& deps) {
+            for (auto d : deps) {
+                if (d >= nodes.size())
+                    throw std::out_of_range("graph: dependency on node " + std::to_string(d) + " which is not recorded yet");
+                nodes[d].dependents.push_back(nodes.size());
+            }
+            n.deps = deps;
+            n.wait.reserve(deps.size());
+            nodes.push_back(std::move(n));
+            release();
+            return nodes.size() - 1;
+        }
+
+        size_t transfer(cl_command_type type, ref buffer, size_t offset, size_t size, ref host, const std::vector<size_t>& deps) {
+            if (buffer.slot != none && slots[buffer.slot].kind != buffer_slot)
+                throw std::invalid_argument("graph: the buffer of a transfer must be a cl_mem param");
+            if (host.slot != none && slots[host.slot].kind != host_slot)
+                throw std::invalid_argument("graph: the host memory of a transfer must be a void* param");
+            if (buffer.slot != none) {
+                auto& s = slots[buffer.slot];
+                s.extent = std::max(s.extent, offset + size);
+                if (s.set)
+                    check_size(cl_mem_of(buffer), s.extent);
+            }
+
+            node n;
+            n.type = type;
+            n.buffer = std::move(buffer);
+            n.offset = offset;
+            n.size = size;
+            n.host = std::move(host);
+            return add(std::move(n), deps);
+        }
+
+        template<typename T>
+        static ref fixed(const T& x) {
+            ref r;
+            r.bytes.assign(reinterpret_cast<const char*>(&x), sizeof(T));
+            return r;
+        }
+
+        static ref to_ref(cl_mem m) { return fixed(m); }
+        static ref to_ref(const mem_buffer& m) { return fixed(m.m); }
+        static ref to_ref(const pooled_buffer& m) { return fixed(m.m); }
+        static ref to_ref(const void* p) { return fixed(p); }
+
+        template<typename T>
+        static ref to_ref(graph_param<T> p) {
+            ref r;
+            r.slot = p.index;
+            return r;
+        }
+
+        kernel_arg to_arg(kernel& k, cl_uint n, cl_mem m) {
+            k.check(n, CL_KERNEL_ARG_ADDRESS_GLOBAL, NULL, "a buffer");
+            return {fixed(m), sizeof(cl_mem), false};
+        }
+
+        kernel_arg to_arg(kernel& k, cl_uint n, const mem_buffer& m) {
+            return to_arg(k, n, m.m);
+        }
+
+        kernel_arg to_arg(kernel& k, cl_uint n, const pooled_buffer& m) {
+            return to_arg(k, n, m.m);
+        }
+
+        kernel_arg to_arg(kernel& k, cl_uint n, const local_memory& l) {
+            k.check(n, CL_KERNEL_ARG_ADDRESS_LOCAL, NULL, "local memory");
+            return {ref(), l.size, true};
+        }
+
+        template<typename T>
+        kernel_arg to_arg(kernel& k, cl_uint n, graph_param<T> p) {
+            auto& s = slots.at(p.index);
+            if (s.kind == host_slot)
+                throw std::invalid_argument("graph: host memory cannot be a kernel argument");
+            if (s.kind == buffer_slot)
+                k.check(n, CL_KERNEL_ARG_ADDRESS_GLOBAL, NULL, "a buffer");
+            else {
+                const char* type = cl_type_name<T>();
+                k.check(n, CL_KERNEL_ARG_ADDRESS_PRIVATE, type, type ? type : "a value");
+            }
+            s.in_kernel = true;
+            return {to_ref(p), sizeof(T), false};
+        }
+
+        template<typename T>
+        kernel_arg to_arg(kernel& k, cl_uint n, const T& x) {
+            static_assert(std::is_trivially_copyable<T>::value, "kernel argument must be trivially copyable");
+            const char* type = cl_type_name<T>();
+            k.check(n, CL_KERNEL_ARG_ADDRESS_PRIVATE, type, type ? type : "a value");
+            return {fixed(x), sizeof(T), false};
+        }
+
+        const std::string& bytes_of(const ref& r) const {
+            return (r.slot == none) ? r.bytes : slots[r.slot].bytes;
+        }
+
+        cl_mem cl_mem_of(const ref& r) const {
+            cl_mem m;
+            std::memcpy(&m, bytes_of(r).data(), sizeof(m));
+            return m;
+        }
+
+        void* pointer_of(const ref& r) const {
+            void* p;
+            std::memcpy(&p, bytes_of(r).data(), sizeof(p));
+            return p;
+        }
+
+        static void check_size(cl_mem m, size_t extent) {
+            size_t sz = 0;
+            cl_int ret = clGetMemObjectInfo(m, CL_MEM_SIZE, sizeof(sz), &sz, NULL);
+            if (ret != CL_SUCCESS)
+                throw clexception("clGetMemObjectInfo", ret);
+            if (sz < extent) {
+                clexception e(CL_INVALID_VALUE);
+                e << "graph: buffer of " << sz << " bytes, transfers need " << extent;
+                throw e;
+            }
+        }
+
+        // the tuned work-group size is looked up once here instead of on every launch
+        // into run_range, so the recorded range stays as it was for a queue prepared later
+        static void prepare_range(command_queue& q, cl_device_id did, node& n) {
+            n.run_range = n.range;
+            auto& r = n.run_range;
+            if (r.local[0] == 0 && r.dims <= 2) {
+                std::vector<size_t> global(r.global, r.global + r.dims);
+                if (auto t = q.tuned(n.k->k, global))
+                    r.with_local(t->local[0], r.dims > 1 ? t->local[1] : 1);
+            }
+            if (r.local[0] == 0)
+                return;
+
+            size_t items = 1;
+            for (cl_uint d = 0; d < r.dims; ++d) {
+                items *= r.local[d];
+                if (r.local[d] == 0 || r.global[d] % r.local[d] != 0) {
+                    clexception e(CL_INVALID_WORK_GROUP_SIZE);
+                    e << "graph: kernel " << n.k->name << ", local size " << r.local[d] << " does not divide " << r.global[d];
+                    throw e;
+                }
+            }
+            if (items > n.k->work_group_size(did)) {
+                clexception e(CL_INVALID_WORK_GROUP_SIZE);
+                e << "graph: kernel " << n.k->name << " runs at most " << n.k->work_group_size(did) << " work-items per group, " << items << " asked";
+                throw e;
+            }
+        }
+
+        void bind_args(node& n) {
+            for (cl_uint i = 0; i < n.args.size(); ++i) {
+                const auto& a = n.args[i];
+                n.k->bind(i, a.size, a.local ? NULL : bytes_of(a.value).data(), a.local);
+            }
+        }
+
+        void run_node(command_queue& q, size_t i) {
+            auto& n = nodes[i];
+            n.wait.clear();
+            for (auto d : n.deps)
+                if (events[d] != NULL)
+                    n.wait.push_back(events[d]);
+
+            // events only for what waits on them, and for the profile
+            const bool keep = out_of_order && !n.dependents.empty();
+            cl_event e = NULL;
+            cl_event* ep = (keep || q.profiling) ? &e : NULL;
+            const cl_event* wp = n.wait.empty() ? NULL : n.wait.data();
+            cl_int ret = CL_SUCCESS;
+            OCL_TRACE_SPAN(n.type == CL_COMMAND_NDRANGE_KERNEL ? "clEnqueueNDRangeKernel"
+                           : n.type == CL_COMMAND_WRITE_BUFFER ? "clEnqueueWriteBuffer" : "clEnqueueReadBuffer",
+                           n.size, (n.k != NULL) ? n.k->name.c_str() : "graph");
+
+            if (n.type == CL_COMMAND_NDRANGE_KERNEL) {
+                bind_args(n);
+                const auto& r = n.run_range;
+                ret = clEnqueueNDRangeKernel(q.q, n.k->k, r.dims, NULL, r.global, (r.local[0] != 0) ? r.local : NULL, n.wait.size(), wp, ep);
+                if (ret != CL_SUCCESS)
+                    throw clexception("clEnqueueNDRangeKernel", ret);
+            }
+            else if (n.type == CL_COMMAND_WRITE_BUFFER) {
+                ret = clEnqueueWriteBuffer(q.q, cl_mem_of(n.buffer), CL_FALSE, n.offset, n.size, pointer_of(n.host), n.wait.size(), wp, ep);
+                if (ret != CL_SUCCESS)
+                    throw clexception("clEnqueueWriteBuffer", ret);
+            }
+            else {
+                ret = clEnqueueReadBuffer(q.q, cl_mem_of(n.buffer), CL_FALSE, n.offset, n.size, pointer_of(n.host), n.wait.size(), wp, ep);
+                if (ret != CL_SUCCESS)
+                    throw clexception("clEnqueueReadBuffer", ret);
+            }
+
+            if (e != NULL)
+                q.track(e, n.type, (n.k != NULL) ? n.k->name : (n.type == CL_COMMAND_WRITE_BUFFER) ? "write" : "read",
+                        n.size, keep ? &events[i] : NULL);
+        }
+
+#ifdef cl_khr_command_buffer
+        // runs of two or more kernel nodes; a single launch gains nothing from a command buffer
+        void make_segments() {
+            for (size_t i = 0; i < nodes.size(); ) {
+                size_t j = i;
+                while (j < nodes.size() && nodes[j].type == CL_COMMAND_NDRANGE_KERNEL && !has_local(nodes[j]))
+                    ++j;
+                if (j - i >= 2) {
+                    for (size_t x = i; x < j; ++x)
+                        nodes[x].segment = segments.size();
+                    segments.push_back({i, j});
+                }
+                i = std::max(j, i + 1);
+            }
+        }
+
+        static bool has_local(const node& n) {
+            for (const auto& a : n.args)
+                if (a.local)
+                    return true;
+            return false;
+        }
+
+        // Commands of a command buffer may run concurrently unless ordered by sync points,
+        // so each kernel waits for the previous one, as on the in-order queue.
+        // Kernel arguments are captured when recorded.
+        void record(command_queue& q, segment& s) {
+            if (s.cb != NULL)
+                api.release(s.cb);
+            s.cb = NULL;
+
+            cl_int ret = CL_SUCCESS;
+            s.cb = api.create(1, &q.q, NULL, &ret);
+            if (ret != CL_SUCCESS)
+                throw clexception("clCreateCommandBufferKHR", ret);
+
+            cl_sync_point_khr prev = 0;
+            for (size_t i = s.first; i < s.last; ++i) {
+                auto& n = nodes[i];
+                bind_args(n);
+                const auto& r = n.run_range;
+                cl_sync_point_khr point = 0;
+                ret = api.ndrange(s.cb, NULL, NULL, n.k->k, r.dims, NULL, r.global, (r.local[0] != 0) ? r.local : NULL,
+                                  (i > s.first) ? 1 : 0, (i > s.first) ? &prev : NULL, &point, NULL);
+                if (ret != CL_SUCCESS)
+                    throw clexception("clCommandNDRangeKernelKHR", ret);
+                prev = point;
+            }
+
+            ret = api.finalize(s.cb);
+            if (ret != CL_SUCCESS)
+                throw clexception("clFinalizeCommandBufferKHR", ret);
+            s.dirty = false;
+        }
+
+        // returns the index of the node after the segment
+        size_t run_segment(command_queue& q, segment& s) {
+            if (s.dirty) {
+                try {
+                    record(q, s);
+                }
+                catch (clexception& e) {
+                    // the queue properties may not suit command buffers: launch the nodes one by one
+                    if (e.ret != CL_INCOMPATIBLE_COMMAND_QUEUE_KHR && e.ret != CL_INVALID_OPERATION && e.ret != CL_INVALID_VALUE)
+                        throw;
+                    if (s.cb != NULL)
+                        api.release(s.cb);
+                    s.cb = NULL;
+                    for (size_t i = s.first; i < s.last; ++i)
+                        nodes[i].segment = none;
+                    for (size_t i = s.first; i < s.last; ++i)
+                        run_node(q, i);
+                    return s.last;
+                }
+            }
+
+            OCL_TRACE_SPAN("clEnqueueCommandBufferKHR", 0, "graph");
+            cl_event e = NULL;
+            cl_int ret = api.enqueue(0, NULL, s.cb, 0, NULL, q.profiling ? &e : NULL);
+            if (ret != CL_SUCCESS)
+                throw clexception("clEnqueueCommandBufferKHR", ret);
+            if (e != NULL)
+                q.track(e, CL_COMMAND_COMMAND_BUFFER_KHR, "graph", 0, NULL);
+            return s.last;
+        }
+#endif
+    };
+}
@@ -1,47 +1,145 @@
 #pragma once
+#include <atomic>
 #include <cstring>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <utility>
 #include <string>
+#include <type_traits>
 #include <vector>
 #include <sstream>
+#include <stdexcept>
 #include <CL/cl.h>        
 
 #include "ocl_error.h"
+#include "ocl_matrix.h"
+#include "ocl_pool.h"
+#include "ocl_program_cache.h"
+#include "ocl_trace.h"
+#include "ocl_tuning_table.h"
 
 namespace ocl {
     
     struct context {
         cl_context ctx;
         cl_device_id did;
+        program_cache* cache;   // may be NULL, then every program is built from source
+        bool host_unified;      // the device works on host memory: integrated GPU or CPU runtime
+        std::unique_ptr<memory_pool> buffer_pool;   // see pool()
 
-        context(cl_device_id id) {
+        context(cl_device_id id, program_cache* cache = NULL) : cache(cache) {
+            OCL_TRACE_SPAN("clCreateContext");
             cl_int ret;
             ctx = clCreateContext(NULL, 1, &id, NULL, NULL, &ret);
             if (ret != CL_SUCCESS)
                 throw clexception("clCreateContext", ret);
             did = id;
+
+            cl_bool unified = CL_FALSE;
+            cl_device_type type = 0;
+            // CL_DEVICE_HOST_UNIFIED_MEMORY is deprecated since 2.0, so a failure just means "no"
+            clGetDeviceInfo(did, CL_DEVICE_HOST_UNIFIED_MEMORY, sizeof(unified), &unified, NULL);
+            clGetDeviceInfo(did, CL_DEVICE_TYPE, sizeof(type), &type, NULL);
+            host_unified = (unified == CL_TRUE) || (type & CL_DEVICE_TYPE_CPU);
+        }
+
+        // Move-only. Objects made with a context (programs, the specialization cache, gemm)
+        // keep a reference or its handles, so it must not move while they are in use.
+        context(const context&) = delete;
+        context(context&& x)
+            : ctx(x.ctx), did(x.did), cache(x.cache), host_unified(x.host_unified), buffer_pool(std::move(x.buffer_pool)) {
+            x.ctx = NULL;
         }
 
         ~context() {
-            clReleaseContext(ctx);
+            buffer_pool.reset();
+            if (ctx != NULL)
+                clReleaseContext(ctx);
+        }
+
+        context& operator=(const context&) = delete;
+        context& operator=(context&& x) {
+            std::swap(ctx, x.ctx);
+            std::swap(did, x.did);
+            std::swap(cache, x.cache);
+            std::swap(host_unified, x.host_unified);
+            std::swap(buffer_pool, x.buffer_pool);
+            return *this;
         }
 
-        cl_mem create_buffer(cl_mem_flags flag, size_t sz) {
+        // Pool of read-write buffers, created on first use. Pooled buffers go back to the
+        // pool instead of the driver and must not outlive the context.
+        memory_pool& pool() {
+            if (!buffer_pool)
+                buffer_pool = std::make_unique<memory_pool>(ctx, did);
+            return *buffer_pool;
+        }
+
+        // host_ptr is for CL_MEM_USE_HOST_PTR / CL_MEM_COPY_HOST_PTR
+        cl_mem create_buffer(cl_mem_flags flag, size_t sz, void* host_ptr = NULL) {
+            OCL_TRACE_SPAN("clCreateBuffer", sz);
             cl_int ret = 0;
-            cl_mem res = clCreateBuffer(ctx, flag, sz, NULL, &ret);
+            cl_mem res = clCreateBuffer(ctx, flag, sz, host_ptr, &ret);
             if (ret != CL_SUCCESS)
                 throw clexception("clCreateBuffer", ret);
             return res;
         }
 
-        cl_command_queue create_queue() {
+        // On a host_unified device the buffer is allocated by the driver in host memory
+        // (CL_MEM_ALLOC_HOST_PTR), and command_queue moves matrices in and out of it through
+        // a mapping instead of a copy. Elsewhere it is an ordinary device buffer.
+        cl_mem create_mapped_buffer(cl_mem_flags flag, size_t sz) {
+            return create_buffer(host_unified ? (flag | CL_MEM_ALLOC_HOST_PTR) : flag, sz);
+        }
+
+        // pass CL_QUEUE_PROFILING_ENABLE to get device timestamps for every command, see ocl_profiling.h
+        // CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE is dropped if the device does not support it,
+        // an in-order queue runs the same command graph, just without overlap
+        cl_command_queue create_queue(cl_command_queue_properties properties = 0) {
+            OCL_TRACE_SPAN("clCreateCommandQueue");
             cl_int ret = 0;
-            cl_command_queue queue = clCreateCommandQueue(ctx, did, 0, &ret);
+            if (properties & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE) {
+                cl_command_queue_properties supported = 0;
+                ret = clGetDeviceInfo(did, CL_DEVICE_QUEUE_PROPERTIES, sizeof(supported), &supported, NULL);
+                if (ret != CL_SUCCESS)
+                    throw clexception("clGetDeviceInfo", ret);
+                if (!(supported & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE))
+                    properties &= ~cl_command_queue_properties(CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE);
+            }
+            cl_command_queue queue = clCreateCommandQueue(ctx, did, properties, &ret);
             if (ret != CL_SUCCESS)
                 throw clexception("clCreateCommandQueue", ret);
             return queue;
         }
 
         cl_program create_program(const char* code, const char* options=NULL) {
+            OCL_TRACE_SPAN("create_program", 0, options);
+            if (cache == NULL)
+                return build_program(code, options);
+
+            const auto key = program_cache::key(did, code, options);
+            std::vector<unsigned char> binary;
+            if (cache->load(key, &binary)) {
+                cl_program program = load_program(binary, options);
+                if (program != NULL)
+                    return program;
+                // stale or rejected by the driver
+                cache->remove(key);
+            }
+
+            cl_program program = build_program(code, options);
+            // like cache I/O, a binary the driver does not give out only means no cache entry
+            try {
+                cache->store(key, get_program_binary(program));
+            }
+            catch (clexception&) {
+            }
+            return program;
+        }
+
+        cl_program build_program(const char* code, const char* options=NULL) {
             cl_int ret = 0;
 
             const char* code_arr[] = {code};
@@ -51,6 +149,7 @@ namespace ocl {
             if (ret != CL_SUCCESS)
                 throw clexception("clCreateProgramWithSource", ret);
         
+            OCL_TRACE_SPAN("clBuildProgram", code_sizes[0], options);
             ret = clBuildProgram(program, 1, &did, options, NULL, NULL); 
             if (ret != CL_SUCCESS) {
                 clexception e(ret);
@@ -59,12 +158,51 @@ namespace ocl {
                 e << "status:  " << getProgramBuildInfo(program, did, CL_PROGRAM_BUILD_STATUS) << "\n";
                 e << "options: " << getProgramBuildInfo(program, did, CL_PROGRAM_BUILD_OPTIONS) << "\n";
                 e << "log:\n" << getProgramBuildInfo(program, did, CL_PROGRAM_BUILD_LOG) << "\n";
+                clReleaseProgram(program);
                 throw e;
             }
 
             return program;
         }
 
+        // returns NULL if the driver does not accept the binary
+        cl_program load_program(const std::vector<unsigned char>& binary, const char* options=NULL) {
+            const unsigned char* bin_arr[] = {binary.data()};
+            size_t bin_sizes[] = {binary.size()};
+            cl_int status = CL_SUCCESS;
+            cl_int ret = 0;
+
+            OCL_TRACE_SPAN("clCreateProgramWithBinary", binary.size(), options);
+            cl_program program = clCreateProgramWithBinary(ctx, 1, &did, bin_sizes, bin_arr, &status, &ret);
+            if (ret != CL_SUCCESS || status != CL_SUCCESS) {
+                if (program != NULL)
+                    clReleaseProgram(program);
+                return NULL;
+            }
+
+            ret = clBuildProgram(program, 1, &did, options, NULL, NULL);
+            if (ret != CL_SUCCESS) {
+                clReleaseProgram(program);
+                return NULL;
+            }
+
+            return program;
+        }
+
+        static std::vector<unsigned char> get_program_binary(cl_program program) {
+            size_t sz = 0;
+            cl_int ret = clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(sz), &sz, NULL);
+            if (ret != CL_SUCCESS)
+                throw clexception("clGetProgramInfo", ret);
+
+            std::vector<unsigned char> res(sz);
+            unsigned char* bin_arr[] = {res.data()};
+            ret = clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(bin_arr), bin_arr, NULL);
+            if (ret != CL_SUCCESS)
+                throw clexception("clGetProgramInfo", ret);
+            return res;
+        }
+
         static std::string getProgramBuildInfo(cl_program program, cl_device_id did, cl_program_build_info param) {
             if (param == CL_PROGRAM_BUILD_STATUS) {
                 // status to string
@@ -99,52 +237,494 @@ namespace ocl {
     };
 
 
+    struct event {
+        cl_event e;
+
+        event(cl_event e = NULL) : e(e) {}
+        event(const event&) = delete;
+        event(event&& x) : e(x.e) {
+            x.e = NULL;
+        }
+        ~event() {
+            if (e != NULL)
+                clReleaseEvent(e);
+        }
+
+        event& operator=(const event&) = delete;
+        event& operator=(event&& x) {
+            std::swap(e, x.e);
+            return *this;
+        }
+
+        void wait() {
+            OCL_TRACE_SPAN("clWaitForEvents");
+            cl_int ret = clWaitForEvents(1, &e);
+            if (ret != CL_SUCCESS)
+                throw clexception("clWaitForEvents", ret);
+        }
+
+        // CL_QUEUED, CL_SUBMITTED, CL_RUNNING, CL_COMPLETE or a negative error code
+        cl_int status() const {
+            cl_int v = 0;
+            cl_int ret = clGetEventInfo(e, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(v), &v, NULL);
+            if (ret != CL_SUCCESS)
+                throw clexception("clGetEventInfo", ret);
+            return v;
+        }
+
+        // completed or failed
+        bool ready() const {
+            return status() <= CL_COMPLETE;
+        }
+
+        void on_complete(std::function<void(cl_int)> fn) const {
+            on_complete(e, std::move(fn));
+        }
+
+        // fn(status) runs once the command completes (status CL_COMPLETE) or fails (negative
+        // status). It is called on a thread of the OpenCL runtime, so it must be short and
+        // must not wait for other commands; exceptions thrown by it are dropped.
+        static void on_complete(cl_event e, std::function<void(cl_int)> fn) {
+            auto f = std::make_unique<std::function<void(cl_int)>>(std::move(fn));
+            cl_int ret = clSetEventCallback(e, CL_COMPLETE, &event::callback, f.get());
+            if (ret != CL_SUCCESS)
+                throw clexception("clSetEventCallback", ret);
+            f.release();
+        }
+
+        static void CL_CALLBACK callback(cl_event, cl_int status, void* p) {
+            std::unique_ptr<std::function<void(cl_int)>> f(static_cast<std::function<void(cl_int)>*>(p));
+            try {
+                (*f)(status);
+            }
+            catch (...) {
+            }
+        }
+
+        // Future which becomes ready when the command completes, or holds a clexception
+        // with the error status if it fails. No thread waits for it in the meantime.
+        std::future<void> future() const {
+            auto p = std::make_shared<std::promise<void>>();
+            auto f = p->get_future();
+            on_complete([p](cl_int status) {
+                if (status == CL_COMPLETE)
+                    p->set_value();
+                else
+                    p->set_exception(std::make_exception_ptr(clexception("event", status)));
+            });
+            return f;
+        }
+
+        operator std::future<void>() const {
+            return future();
+        }
+
+        // event completed from the host with set_status()
+        static event user(cl_context ctx) {
+            cl_int ret = 0;
+            cl_event e = clCreateUserEvent(ctx, &ret);
+            if (ret != CL_SUCCESS)
+                throw clexception("clCreateUserEvent", ret);
+            return event(e);
+        }
+
+        static void set_status(cl_event e, cl_int status) {
+            cl_int ret = clSetUserEventStatus(e, status);
+            if (ret != CL_SUCCESS)
+                throw clexception("clSetUserEventStatus", ret);
+        }
+
+        // CL_PROFILING_COMMAND_QUEUED/SUBMIT/START/END, nanoseconds of the device clock
+        cl_ulong profiling_info(cl_profiling_info param) const {
+            return profiling_info(e, param);
+        }
+
+        static cl_ulong profiling_info(cl_event e, cl_profiling_info param) {
+            cl_ulong v = 0;
+            cl_int ret = clGetEventProfilingInfo(e, param, sizeof(v), &v, NULL);
+            if (ret != CL_SUCCESS)
+                throw clexception("clGetEventProfilingInfo", ret);
+            return v;
+        }
+    };
+
+
+    // Event of the same context which completes when all events complete, or fails with the
+    // first error status if any of them fails. It can go into the wait list of any queue of
+    // that context, or be turned into a future.
+    event when_all(const std::vector<cl_event>& events) {
+        if (events.empty())
+            throw std::invalid_argument("when_all: no events");
+
+        cl_context ctx = NULL;
+        cl_int ret = clGetEventInfo(events[0], CL_EVENT_CONTEXT, sizeof(ctx), &ctx, NULL);
+        if (ret != CL_SUCCESS)
+            throw clexception("clGetEventInfo", ret);
+
+        struct state {
+            cl_event all;
+            std::atomic<size_t> left;
+            std::atomic<cl_int> status{CL_COMPLETE};
+
+            void arrive(cl_int s, size_t n = 1) {
+                if (s < 0) {
+                    cl_int ok = CL_COMPLETE;
+                    status.compare_exchange_strong(ok, s);
+                }
+                if (left.fetch_sub(n) == n) {
+                    clSetUserEventStatus(all, status);
+                    clReleaseEvent(all);
+                }
+            }
+        };
+
+        event all = event::user(ctx);
+        clRetainEvent(all.e);   // released by the last arrival
+        auto st = std::make_shared<state>();
+        st->all = all.e;
+        st->left = events.size() + 1;   // one extra for the registration loop
+
+        size_t registered = 0;
+        try {
+            for (; registered < events.size(); ++registered)
+                event::on_complete(events[registered], [st](cl_int s) { st->arrive(s); });
+        }
+        catch (clexception& e) {
+            st->arrive(e.ret, events.size() - registered + 1);
+            throw;
+        }
+        st->arrive(CL_COMPLETE);
+        return all;
+    }
+
+
+    // command enqueued to a queue with CL_QUEUE_PROFILING_ENABLE
+    struct queued_command {
+        cl_command_type type;   // CL_COMMAND_NDRANGE_KERNEL, CL_COMMAND_WRITE_BUFFER, ...
+        std::string name;       // kernel function name, "write" or "read"
+        size_t bytes;           // transfer size, 0 for kernels
+        cl_event e;
+    };
+
+
+    // Typed view of a mapped buffer region, unmapped on destruction
+    template<typename T>
+    struct mapped_buffer {
+        cl_command_queue q;
+        cl_mem m;
+        T* ptr;
+        size_t count;
+
+        mapped_buffer(cl_command_queue q, cl_mem m, T* ptr, size_t count) : q(q), m(m), ptr(ptr), count(count) {}
+        mapped_buffer(const mapped_buffer&) = delete;
+        mapped_buffer(mapped_buffer&& x) : q(x.q), m(x.m), ptr(x.ptr), count(x.count) {
+            x.ptr = NULL;
+        }
+        ~mapped_buffer() {
+            if (ptr != NULL)
+                clEnqueueUnmapMemObject(q, m, ptr, 0, NULL, NULL);
+        }
+
+        mapped_buffer& operator=(const mapped_buffer&) = delete;
+
+        // the unmap is enqueued, later commands of the same queue see the data
+        void unmap() {
+            if (ptr == NULL)
+                return;
+            cl_int ret = clEnqueueUnmapMemObject(q, m, ptr, 0, NULL, NULL);
+            ptr = NULL;
+            if (ret != CL_SUCCESS)
+                throw clexception("clEnqueueUnmapMemObject", ret);
+        }
+
+        T* data() const { return ptr; }
+        size_t size() const { return count; }
+        T* begin() const { return ptr; }
+        T* end() const { return ptr + count; }
+        T& operator[](size_t i) const { return ptr[i]; }
+
+        matrix_view<T> view(size_t rows, size_t cols) const {
+            if (rows * cols > count)
+                throw std::out_of_range("mapped_buffer::view: view is bigger than the mapping");
+            return matrix_view<T>(ptr, rows, cols);
+        }
+    };
+
+
+    // Commands taking `cl_event* ev` and a wait list give their event to the caller if ev is
+    // not NULL and start after the events in wait; the enqueue_* ones return the event.
+    // On an out-of-order queue nothing is ordered but what the wait lists (or barrier()) say.
     struct command_queue {
         cl_command_queue q;
+        bool profiling;
+        bool out_of_order;
+        std::vector<queued_command> commands;   // filled only if profiling
+        tuning_table* tuning = NULL;            // if set, run1d/run2d without a work-group size take the tuned one
+        std::string device_name;                // set on the first tuning lookup
+
+        command_queue(cl_command_queue q) : q(q) {
+            cl_command_queue_properties properties = 0;
+            cl_int ret = clGetCommandQueueInfo(q, CL_QUEUE_PROPERTIES, sizeof(properties), &properties, NULL);
+            if (ret != CL_SUCCESS)
+                throw clexception("clGetCommandQueueInfo", ret);
+            profiling = (properties & CL_QUEUE_PROFILING_ENABLE) != 0;
+            out_of_order = (properties & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE) != 0;
+        }
+
+        command_queue(const command_queue&) = delete;
+        command_queue(command_queue&& x)
+            : q(x.q), profiling(x.profiling), out_of_order(x.out_of_order), commands(std::move(x.commands)),
+              tuning(x.tuning), device_name(std::move(x.device_name)) {
+            x.q = NULL;
+            x.commands.clear();
+        }
 
-        command_queue(cl_command_queue q) : q(q) {}
         ~command_queue() {
-            clReleaseCommandQueue(q);
+            clear_commands();
+            if (q != NULL)
+                clReleaseCommandQueue(q);
+        }
+
+        command_queue& operator=(const command_queue&) = delete;
+        command_queue& operator=(command_queue&& x) {
+            std::swap(q, x.q);
+            std::swap(profiling, x.profiling);
+            std::swap(out_of_order, x.out_of_order);
+            std::swap(commands, x.commands);
+            std::swap(tuning, x.tuning);
+            std::swap(device_name, x.device_name);
+            return *this;
         }
 
         void finish() {
+            OCL_TRACE_SPAN("clFinish");
             clFlush(q);
             clFinish(q);
         }
 
+        // submits the enqueued commands to the device without waiting for them
+        void flush() {
+            OCL_TRACE_SPAN("clFlush");
+            cl_int ret = clFlush(q);
+            if (ret != CL_SUCCESS)
+                throw clexception("clFlush", ret);
+        }
+
+        event enqueue_write(cl_mem m, size_t offset, const void* data, size_t sz, const std::vector<cl_event>& wait = {}) {
+            event ev;
+            write_buffer(m, offset, data, sz, false, &ev.e, wait);
+            return ev;
+        }
+
+        event enqueue_read(cl_mem m, size_t offset, void* p, size_t sz, const std::vector<cl_event>& wait = {}) {
+            event ev;
+            read_buffer(m, offset, p, sz, false, &ev.e, wait);
+            return ev;
+        }
+
+        template<typename T>
+        event enqueue_write(cl_mem m, size_t offset, matrix_view<T> v, const std::vector<cl_event>& wait = {}) {
+            event ev;
+            write_matrix(m, offset, v, false, &ev.e, wait);
+            return ev;
+        }
+
+        template<typename T>
+        event enqueue_read(cl_mem m, size_t offset, matrix_view<T> v, const std::vector<cl_event>& wait = {}) {
+            event ev;
+            read_matrix(m, offset, v, false, &ev.e, wait);
+            return ev;
+        }
+
+        // completes when the events in wait (all earlier commands if it is empty) complete
+        event marker(const std::vector<cl_event>& wait = {}) {
+            OCL_TRACE_SPAN("clEnqueueMarkerWithWaitList");
+            event ev;
+            cl_int ret = clEnqueueMarkerWithWaitList(q, wait.size(), wait_ptr(wait), &ev.e);
+            if (ret != CL_SUCCESS)
+                throw clexception("clEnqueueMarkerWithWaitList", ret);
+            return ev;
+        }
+
+        // like marker(), and later commands do not start before it completes
+        event barrier(const std::vector<cl_event>& wait = {}) {
+            OCL_TRACE_SPAN("clEnqueueBarrierWithWaitList");
+            event ev;
+            cl_int ret = clEnqueueBarrierWithWaitList(q, wait.size(), wait_ptr(wait), &ev.e);
+            if (ret != CL_SUCCESS)
+                throw clexception("clEnqueueBarrierWithWaitList", ret);
+            return ev;
+        }
+
+        void clear_commands() {
+            for (auto& c : commands)
+                clReleaseEvent(c.e);
+            commands.clear();
+        }
+
         template<typename T>
         size_t write_buffer(cl_mem m, const std::vector<T>& v) {
-            return write_buffer(m, 0, &v[0], v.size() * sizeof(T), false);
+            return write_buffer(m, 0, &v[0], v.size() * sizeof(T), true);
         }
 
         template<typename T>
         size_t write_buffer_async(cl_mem m, size_t offset, const std::vector<T>& v) {
-            return write_buffer(m, offset, &v[0], v.size() * sizeof(T), true);
+            return write_buffer(m, offset, &v[0], v.size() * sizeof(T), false);
+        }
+
+        // A matrix or a view lands in the buffer densely packed (row stride = cols), whatever
+        // its leading dimension on the host is. The _async variants always enqueue a write
+        // command and return at once; the blocking ones fill a buffer from
+        // context::create_mapped_buffer through a mapping instead (see write_matrix).
+        template<typename T>
+        size_t write_buffer(cl_mem m, const matrix<T>& x) {
+            return write_matrix(m, 0, x.view(), true);
+        }
+
+        template<typename T>
+        size_t write_buffer(cl_mem m, matrix_view<T> v) {
+            return write_matrix(m, 0, v, true);
+        }
+
+        template<typename T>
+        size_t write_buffer_async(cl_mem m, size_t offset, const matrix<T>& x) {
+            return write_matrix(m, offset, x.view(), false);
+        }
+
+        template<typename T>
+        size_t write_buffer_async(cl_mem m, size_t offset, matrix_view<T> v) {
+            return write_matrix(m, offset, v, false);
+        }
+
+        // Blocks until the region is mapped. flags: CL_MAP_READ, CL_MAP_WRITE or
+        // CL_MAP_WRITE_INVALIDATE_REGION if the old content is not needed.
+        template<typename T>
+        mapped_buffer<T> map_buffer(cl_mem m, cl_map_flags flags, size_t offset, size_t count) {
+            OCL_TRACE_SPAN("clEnqueueMapBuffer", count * sizeof(T));
+            cl_int ret = 0;
+            cl_event e = NULL;
+            void* p = clEnqueueMapBuffer(q, m, CL_TRUE, flags, offset * sizeof(T), count * sizeof(T), 0, NULL, event_ptr(NULL, &e), &ret);
+            if (ret != CL_SUCCESS)
+                throw clexception("clEnqueueMapBuffer", ret);
+            track(e, CL_COMMAND_MAP_BUFFER, "map", count * sizeof(T), NULL);
+            return mapped_buffer<T>(q, m, static_cast<T*>(p), count);
+        }
+
+        // like b.unmap(), and the unmap shows in the profile
+        template<typename T>
+        void unmap(mapped_buffer<T>& b) {
+            if (b.ptr == NULL)
+                return;
+            cl_event e = NULL;
+            cl_int ret = clEnqueueUnmapMemObject(q, b.m, b.ptr, 0, NULL, event_ptr(NULL, &e));
+            b.ptr = NULL;
+            if (ret != CL_SUCCESS)
+                throw clexception("clEnqueueUnmapMemObject", ret);
+            track(e, CL_COMMAND_UNMAP_MEM_OBJECT, "unmap", 0, NULL);
         }
 
-        size_t write_buffer(cl_mem m, size_t offset, const void* data, size_t sz, bool sync) {
+        // the buffer lives in host memory, so mapping it costs nothing
+        static bool is_host_mapped(cl_mem m) {
+            cl_mem_flags flags = 0;
+            cl_int ret = clGetMemObjectInfo(m, CL_MEM_FLAGS, sizeof(flags), &flags, NULL);
+            if (ret != CL_SUCCESS)
+                throw clexception("clGetMemObjectInfo", ret);
+            return (flags & (CL_MEM_ALLOC_HOST_PTR | CL_MEM_USE_HOST_PTR)) != 0;
+        }
+
+        // A blocking write without events into a buffer from context::create_mapped_buffer
+        // goes through a mapping (the copy is done by the host, no driver copy); everything
+        // else, including every asynchronous write, is one write command.
+        template<typename T>
+        size_t write_matrix(cl_mem m, size_t offset, matrix_view<T> v, bool sync, cl_event* ev = NULL, const std::vector<cl_event>& wait = {}) {
+            const size_t row_bytes = v.cols * sizeof(T);
+            if (sync && ev == NULL && wait.empty() && is_host_mapped(m)) {
+                auto dst = map_buffer<char>(m, CL_MAP_WRITE_INVALIDATE_REGION, offset, v.rows * row_bytes);
+                // a CL_MEM_USE_HOST_PTR buffer may be mapped right onto the source
+                if (dst.data() != reinterpret_cast<const char*>(v.data))
+                    copy(v, matrix_view<std::remove_const_t<T>>(reinterpret_cast<std::remove_const_t<T>*>(dst.data()), v.rows, v.cols));
+                unmap(dst);
+                return v.rows * row_bytes;
+            }
+            if (v.contiguous())
+                return write_buffer(m, offset, v.data, v.rows * row_bytes, sync, ev, wait);
+
+            size_t buffer_origin[] = {offset, 0, 0};
+            size_t host_origin[] = {0, 0, 0};
+            size_t region[] = {row_bytes, v.rows, 1};
+            cl_event e = NULL;
+            OCL_TRACE_SPAN("clEnqueueWriteBufferRect", v.rows * row_bytes);
+            cl_int ret = clEnqueueWriteBufferRect(q, m, sync ? CL_TRUE : CL_FALSE, buffer_origin, host_origin, region,
+                row_bytes, 0, v.ld * sizeof(T), 0, v.data, wait.size(), wait_ptr(wait), event_ptr(ev, &e));
+            if (ret != CL_SUCCESS)
+                throw clexception("clEnqueueWriteBufferRect", ret);
+            track(e, CL_COMMAND_WRITE_BUFFER_RECT, "write", v.rows * row_bytes, ev);
+            return v.rows * row_bytes;
+        }
+
+        // If ev is not NULL it receives the event of the command, the caller releases it.
+        // The command starts after all events in wait are complete.
+        size_t write_buffer(cl_mem m, size_t offset, const void* data, size_t sz, bool sync, cl_event* ev = NULL, const std::vector<cl_event>& wait = {}) {
+            OCL_TRACE_SPAN("clEnqueueWriteBuffer", sz);
             cl_int ret = 0;
-            ret = clEnqueueWriteBuffer(q, m, sync ? CL_TRUE : CL_FALSE, offset, sz, data, 0, NULL, NULL);
+            cl_event e = NULL;
+            ret = clEnqueueWriteBuffer(q, m, sync ? CL_TRUE : CL_FALSE, offset, sz, data, wait.size(), wait_ptr(wait), event_ptr(ev, &e));
             if (ret != CL_SUCCESS)
                 throw clexception("clEnqueueWriteBuffer", ret);
+            track(e, CL_COMMAND_WRITE_BUFFER, "write", sz, ev);
             return sz;
         }
 
 
-        void run1d(cl_kernel kernel, size_t range, size_t ws = 0) {
-            run(kernel, 1, &range, (ws != 0) ? &ws : NULL);
+        void run1d(cl_kernel kernel, size_t range, size_t ws = 0, cl_event* ev = NULL, const std::vector<cl_event>& wait = {}) {
+            if (ws == 0) {
+                if (auto t = tuned(kernel, {range}))
+                    ws = t->local[0];
+            }
+            run(kernel, 1, &range, (ws != 0) ? &ws : NULL, ev, wait);
         }
 
-        void run2d(cl_kernel kernel, size_t range1, size_t range2, size_t ws1 = 0, size_t ws2 = 0) {
+        void run2d(cl_kernel kernel, size_t range1, size_t range2, size_t ws1 = 0, size_t ws2 = 0,
+                   cl_event* ev = NULL, const std::vector<cl_event>& wait = {}) {
+            if (ws1 == 0) {
+                if (auto t = tuned(kernel, {range1, range2})) {
+                    ws1 = t->local[0];
+                    ws2 = t->local[1];
+                }
+            }
             size_t ranges[] = {range1, range2};
             size_t wss[] = {ws1, ws2};
-            run(kernel, 2, ranges, (ws1 != 0) ? wss : NULL);
+            run(kernel, 2, ranges, (ws1 != 0) ? wss : NULL, ev, wait);
+        }
+
+        // tuning entry for the kernel on this device and global range, NULL if there is none
+        const tuned_config* tuned(cl_kernel kernel, const std::vector<size_t>& range) {
+            if (tuning == NULL)
+                return NULL;
+            if (device_name.empty()) {
+                cl_device_id did = NULL;
+                cl_int ret = clGetCommandQueueInfo(q, CL_QUEUE_DEVICE, sizeof(did), &did, NULL);
+                if (ret != CL_SUCCESS)
+                    throw clexception("clGetCommandQueueInfo", ret);
+                device_name = get_device_data<std::string>(did, CL_DEVICE_NAME);
+            }
+            auto t = tuning->find(device_name, kernel_name(kernel), range);
+            // a tuned size which does not divide this range is of no use
+            if (t != NULL) {
+                for (size_t i = 0; i < range.size(); ++i)
+                    if (t->local[i] == 0 || range[i] % t->local[i] != 0)
+                        return NULL;
+            }
+            return t;
         }
 
-        void run(cl_kernel kernel, size_t ndims, size_t* range, size_t* ws) {
-            cl_int ret = clEnqueueNDRangeKernel(q, kernel, ndims, NULL, range, ws, 0, NULL, NULL);
+        void run(cl_kernel kernel, size_t ndims, size_t* range, size_t* ws, cl_event* ev = NULL, const std::vector<cl_event>& wait = {}) {
+            OCL_TRACE_SPAN("clEnqueueNDRangeKernel", 0, trace_kernel_name(kernel));
+            cl_event e = NULL;
+            cl_int ret = clEnqueueNDRangeKernel(q, kernel, ndims, NULL, range, ws, wait.size(), wait_ptr(wait), event_ptr(ev, &e));
             if (ret != CL_SUCCESS)
                 throw clexception("clEnqueueNDRangeKernel", ret);            
+            track(e, CL_COMMAND_NDRANGE_KERNEL, profiling ? kernel_name(kernel) : std::string(), 0, ev);
         }
 
 
@@ -158,53 +738,444 @@ namespace ocl {
             return read_buffer(m, offset, &((*p)[0]), p->size() * sizeof(T), false);
         } 
 
-        size_t read_buffer(cl_mem m, size_t offset, void* p, size_t sz, bool sync=true) {
-            cl_int ret = clEnqueueReadBuffer(q, m, sync ? CL_TRUE : CL_FALSE, offset, sz, p, 0, NULL, NULL);
+        template<typename T>
+        void read_buffer(cl_mem m, matrix<T>* x) {
+            read_matrix(m, 0, x->view(), true);
+        }
+
+        template<typename T>
+        void read_buffer(cl_mem m, matrix_view<T> v) {
+            read_matrix(m, 0, v, true);
+        }
+
+        template<typename T>
+        size_t read_buffer_async(cl_mem m, size_t offset, matrix<T>* x) {
+            return read_matrix(m, offset, x->view(), false);
+        }
+
+        template<typename T>
+        size_t read_buffer_async(cl_mem m, size_t offset, matrix_view<T> v) {
+            return read_matrix(m, offset, v, false);
+        }
+
+        // reads a densely packed rows x cols block into the view; like write_matrix, through
+        // a mapping only if it is blocking
+        template<typename T>
+        size_t read_matrix(cl_mem m, size_t offset, matrix_view<T> v, bool sync, cl_event* ev = NULL, const std::vector<cl_event>& wait = {}) {
+            const size_t row_bytes = v.cols * sizeof(T);
+            if (sync && ev == NULL && wait.empty() && is_host_mapped(m)) {
+                auto src = map_buffer<char>(m, CL_MAP_READ, offset, v.rows * row_bytes);
+                if (src.data() != reinterpret_cast<const char*>(v.data))
+                    copy(matrix_view<const T>(reinterpret_cast<const T*>(src.data()), v.rows, v.cols), v);
+                unmap(src);
+                return v.rows * row_bytes;
+            }
+            if (v.contiguous())
+                return read_buffer(m, offset, v.data, v.rows * row_bytes, sync, ev, wait);
+
+            size_t buffer_origin[] = {offset, 0, 0};
+            size_t host_origin[] = {0, 0, 0};
+            size_t region[] = {row_bytes, v.rows, 1};
+            cl_event e = NULL;
+            OCL_TRACE_SPAN("clEnqueueReadBufferRect", v.rows * row_bytes);
+            cl_int ret = clEnqueueReadBufferRect(q, m, sync ? CL_TRUE : CL_FALSE, buffer_origin, host_origin, region,
+                row_bytes, 0, v.ld * sizeof(T), 0, v.data, wait.size(), wait_ptr(wait), event_ptr(ev, &e));
+            if (ret != CL_SUCCESS)
+                throw clexception("clEnqueueReadBufferRect", ret);
+            track(e, CL_COMMAND_READ_BUFFER_RECT, "read", v.rows * row_bytes, ev);
+            return v.rows * row_bytes;
+        }
+
+        size_t read_buffer(cl_mem m, size_t offset, void* p, size_t sz, bool sync=true, cl_event* ev = NULL, const std::vector<cl_event>& wait = {}) {
+            OCL_TRACE_SPAN("clEnqueueReadBuffer", sz);
+            cl_event e = NULL;
+            cl_int ret = clEnqueueReadBuffer(q, m, sync ? CL_TRUE : CL_FALSE, offset, sz, p, wait.size(), wait_ptr(wait), event_ptr(ev, &e));
             if (ret != CL_SUCCESS)
                 throw clexception("clEnqueueReadBuffer", ret);
+            track(e, CL_COMMAND_READ_BUFFER, "read", sz, ev);
             return sz;
         } 
+
+        static std::string kernel_name(cl_kernel kernel) {
+            size_t sz = 0;
+            cl_int ret = clGetKernelInfo(kernel, CL_KERNEL_FUNCTION_NAME, 0, NULL, &sz);
+            if (ret != CL_SUCCESS)
+                throw clexception("clGetKernelInfo", ret);
+
+            std::string res(sz, '\0');
+            ret = clGetKernelInfo(kernel, CL_KERNEL_FUNCTION_NAME, sz, &res[0], NULL);
+            if (ret != CL_SUCCESS)
+                throw clexception("clGetKernelInfo", ret);
+            while (res.size() && res.back() == 0)
+                res.pop_back();
+            return res;
+        }
+
+        static const cl_event* wait_ptr(const std::vector<cl_event>& wait) {
+            return wait.empty() ? NULL : wait.data();
+        }
+
+        // an event is requested from OpenCL only if somebody needs it
+        cl_event* event_ptr(cl_event* ev, cl_event* e) {
+            return (ev != NULL || profiling) ? e : NULL;
+        }
+
+        void track(cl_event e, cl_command_type type, std::string name, size_t bytes, cl_event* ev) {
+            if (e == NULL)
+                return;
+            if (profiling) {
+#ifdef OCL_TRACE
+                trace_device_command(q, e, type, name, bytes);
+#endif
+                clRetainEvent(e);
+                commands.push_back({type, std::move(name), bytes, e});
+            }
+            if (ev != NULL)
+                *ev = e;
+            else
+                clReleaseEvent(e);
+        }
+    };
+
+
+    struct mem_buffer {
+        cl_mem m;
+        mem_buffer(cl_mem m = NULL) : m(m) {}
+        mem_buffer(const mem_buffer&) = delete;
+        mem_buffer(mem_buffer&& x) : m(x.m) {
+            x.m = NULL;
+        }
+        ~mem_buffer() {
+            if (m != NULL)
+                clReleaseMemObject(m);
+        }
+
+        mem_buffer& operator=(const mem_buffer&) = delete;
+        mem_buffer& operator=(mem_buffer&& x) {
+            std::swap(m, x.m);
+            return *this;
+        }
     };
 
 
+    // Size in bytes of a __local kernel argument, see kernel::set_args
+    struct local_memory {
+        size_t size;
+    };
+
+
+    // Global and local work sizes of a launch; a local size of 0 leaves the choice
+    // to the driver or to the queue's tuning table
+    struct nd_range {
+        cl_uint dims;
+        size_t global[3] = {1, 1, 1};
+        size_t local[3] = {0, 0, 0};
+
+        nd_range(size_t g0) : dims(1) {
+            global[0] = g0;
+        }
+        nd_range(size_t g0, size_t g1) : dims(2) {
+            global[0] = g0;
+            global[1] = g1;
+        }
+        nd_range(size_t g0, size_t g1, size_t g2) : dims(3) {
+            global[0] = g0;
+            global[1] = g1;
+            global[2] = g2;
+        }
+
+        nd_range& with_local(size_t l0, size_t l1 = 1, size_t l2 = 1) {
+            local[0] = l0;
+            local[1] = l1;
+            local[2] = l2;
+            return *this;
+        }
+    };
+
+
+    // OpenCL C name of a scalar type, NULL if it has no exact counterpart
+    template<typename T>
+    const char* cl_type_name() {
+        if (std::is_same<T, float>::value)
+            return "float";
+        if (std::is_same<T, double>::value)
+            return "double";
+        if (std::is_integral<T>::value && !std::is_same<T, bool>::value) {
+            static const char* names[2][4] = {{"char", "short", "int", "long"}, {"uchar", "ushort", "uint", "ulong"}};
+            const size_t i = (sizeof(T) == 1) ? 0 : (sizeof(T) == 2) ? 1 : (sizeof(T) == 4) ? 2 : 3;
+            return names[std::is_unsigned<T>::value][i];
+        }
+        return NULL;
+    }
+
+
+    // Kernel with typed argument binding:
+    //
+    //     k(q, nd_range(n).with_local(64), count, in_buffer, out_buffer, local_memory{64 * sizeof(float)});
+    //
+    // Arguments are bound by position: cl_mem, mem_buffer and pooled_buffer for buffers,
+    // local_memory for __local pointers, any trivially copyable value for the rest.
+    // The argument count is always checked; types and address spaces only if the program
+    // was built with -cl-kernel-arg-info (otherwise the driver does not report them).
+    // The last bound value of every argument is remembered and clSetKernelArg is skipped
+    // when it does not change; setArg() and clear_args() forget it. Setting arguments of
+    // k directly with clSetKernelArg leaves the remembered values stale.
     struct kernel {
+        struct bound_arg {
+            bool set = false;
+            bool local = false;
+            size_t size = 0;
+            std::string bytes;      // the value, empty for local memory
+        };
+
+        struct arg_info {
+            cl_kernel_arg_address_qualifier address;
+            std::string type_name;
+        };
+
         cl_kernel k;
+        bool loaded = false;            // name, bound and info are filled on the first typed call
+        std::string name;
+        std::vector<bound_arg> bound;   // one per kernel argument
+        std::vector<arg_info> info;     // empty if the driver does not report argument info
 
         kernel(cl_kernel k) : k(k) {}
+        kernel(const kernel&) = delete;
+        kernel(kernel&& x) : k(x.k), loaded(x.loaded), name(std::move(x.name)), bound(std::move(x.bound)), info(std::move(x.info)) {
+            x.k = NULL;
+            x.loaded = false;
+        }
         ~kernel() {
-            clReleaseKernel(k);
+            if (k != NULL)
+                clReleaseKernel(k);
+        }
+
+        kernel& operator=(const kernel&) = delete;
+        kernel& operator=(kernel&& x) {
+            std::swap(k, x.k);
+            std::swap(loaded, x.loaded);
+            std::swap(name, x.name);
+            std::swap(bound, x.bound);
+            std::swap(info, x.info);
+            return *this;
         }
 
         void setArg(int n, int sz, const void* p) {
             cl_int ret = clSetKernelArg(k, n, sz, p);
             if (ret != CL_SUCCESS)
                 throw clexception("clSetKernelArg", ret);
+            if (size_t(n) < bound.size())
+                bound[n].set = false;
+        }
+
+        // CL_KERNEL_WORK_GROUP_SIZE: may be less than the device limit if the kernel uses many registers
+        size_t work_group_size(cl_device_id did) {
+            size_t sz = 0;
+            cl_int ret = clGetKernelWorkGroupInfo(k, did, CL_KERNEL_WORK_GROUP_SIZE, sizeof(sz), &sz, NULL);
+            if (ret != CL_SUCCESS)
+                throw clexception("clGetKernelWorkGroupInfo", ret);
+            return sz;
+        }
+
+        size_t num_args() {
+            load_arg_info();
+            return bound.size();
+        }
+
+        // binds all arguments of the kernel
+        template<typename... Args>
+        kernel& set_args(const Args&... args) {
+            load_arg_info();
+            OCL_TRACE_SPAN("set_args", 0, name);
+            if (sizeof...(Args) != bound.size()) {
+                clexception e(CL_INVALID_KERNEL_ARGS);
+                e << "kernel " << name << " takes " << bound.size() << " arguments, " << sizeof...(Args) << " given";
+                throw e;
+            }
+            cl_uint n = 0;
+            (set_arg(n++, args), ...);
+            return *this;
+        }
+
+        void set_arg(cl_uint n, cl_mem m) {
+            check(n, CL_KERNEL_ARG_ADDRESS_GLOBAL, NULL, "a buffer");
+            bind(n, sizeof(m), &m, false);
+        }
+
+        void set_arg(cl_uint n, const mem_buffer& m) {
+            set_arg(n, m.m);
+        }
+
+        void set_arg(cl_uint n, const pooled_buffer& m) {
+            set_arg(n, m.m);
+        }
+
+        void set_arg(cl_uint n, const local_memory& l) {
+            check(n, CL_KERNEL_ARG_ADDRESS_LOCAL, NULL, "local memory");
+            bind(n, l.size, NULL, true);
+        }
+
+        template<typename T>
+        void set_arg(cl_uint n, const T& x) {
+            static_assert(std::is_trivially_copyable<T>::value, "kernel argument must be trivially copyable");
+            const char* type = cl_type_name<T>();
+            check(n, CL_KERNEL_ARG_ADDRESS_PRIVATE, type, type ? type : "a value");
+            bind(n, sizeof(T), &x, false);
+        }
+
+        void clear_args() {
+            for (auto& b : bound)
+                b.set = false;
+        }
+
+        // binds args and enqueues the kernel
+        template<typename... Args>
+        void operator()(command_queue& q, const nd_range& r, const Args&... args) {
+            set_args(args...);
+            run(q, r);
+        }
+
+        // binds args, enqueues the kernel after the events in wait and returns its event
+        template<typename... Args>
+        event async(command_queue& q, const nd_range& r, const std::vector<cl_event>& wait, const Args&... args) {
+            set_args(args...);
+            return enqueue(q, r, wait);
+        }
+
+        event enqueue(command_queue& q, const nd_range& r, const std::vector<cl_event>& wait = {}) {
+            event ev;
+            run(q, r, &ev.e, wait);
+            return ev;
+        }
+
+        // enqueues the kernel with the arguments bound so far
+        void run(command_queue& q, const nd_range& r, cl_event* ev = NULL, const std::vector<cl_event>& wait = {}) {
+            if (r.dims == 1) {
+                q.run1d(k, r.global[0], r.local[0], ev, wait);
+            }
+            else if (r.dims == 2) {
+                q.run2d(k, r.global[0], r.global[1], r.local[0], r.local[1], ev, wait);
+            }
+            else {
+                size_t global[] = {r.global[0], r.global[1], r.global[2]};
+                size_t local[] = {r.local[0], r.local[1], r.local[2]};
+                q.run(k, r.dims, global, (local[0] != 0) ? local : NULL, ev, wait);
+            }
+        }
+
+        void load_arg_info() {
+            if (loaded)
+                return;
+
+            cl_uint count = 0;
+            cl_int ret = clGetKernelInfo(k, CL_KERNEL_NUM_ARGS, sizeof(count), &count, NULL);
+            if (ret != CL_SUCCESS)
+                throw clexception("clGetKernelInfo", ret);
+            name = command_queue::kernel_name(k);
+            bound.resize(count);
+            loaded = true;
+
+            for (cl_uint i = 0; i < count; ++i) {
+                arg_info a;
+                ret = clGetKernelArgInfo(k, i, CL_KERNEL_ARG_ADDRESS_QUALIFIER, sizeof(a.address), &a.address, NULL);
+                if (ret == CL_KERNEL_ARG_INFO_NOT_AVAILABLE) {
+                    info.clear();
+                    return;
+                }
+                if (ret != CL_SUCCESS)
+                    throw clexception("clGetKernelArgInfo", ret);
+
+                size_t sz = 0;
+                ret = clGetKernelArgInfo(k, i, CL_KERNEL_ARG_TYPE_NAME, 0, NULL, &sz);
+                if (ret != CL_SUCCESS)
+                    throw clexception("clGetKernelArgInfo", ret);
+                a.type_name.resize(sz);
+                ret = clGetKernelArgInfo(k, i, CL_KERNEL_ARG_TYPE_NAME, sz, &a.type_name[0], NULL);
+                if (ret != CL_SUCCESS)
+                    throw clexception("clGetKernelArgInfo", ret);
+                while (a.type_name.size() && a.type_name.back() == 0)
+                    a.type_name.pop_back();
+                info.push_back(std::move(a));
+            }
+        }
+
+        // type is the expected CL_KERNEL_ARG_TYPE_NAME, NULL to check the address space only
+        void check(cl_uint n, cl_kernel_arg_address_qualifier address, const char* type, const char* given) {
+            load_arg_info();
+            if (n >= bound.size())
+                throw std::out_of_range("kernel " + name + ": no argument " + std::to_string(n));
+            if (info.empty())
+                return;
+
+            const auto& a = info[n];
+            bool ok = (address == CL_KERNEL_ARG_ADDRESS_GLOBAL)
+                ? (a.address == CL_KERNEL_ARG_ADDRESS_GLOBAL || a.address == CL_KERNEL_ARG_ADDRESS_CONSTANT)
+                : (a.address == address);
+            if (ok && type != NULL)
+                ok = (a.type_name == type);
+            if (!ok) {
+                clexception e(CL_INVALID_ARG_VALUE);
+                e << "kernel " << name << ": argument " << n << " is " << a.type_name << ", got " << given;
+                throw e;
+            }
+        }
+
+        void bind(cl_uint n, size_t sz, const void* p, bool local) {
+            auto& b = bound[n];
+            if (b.set && b.local == local && b.size == sz && (local || std::memcmp(b.bytes.data(), p, sz) == 0))
+                return;
+
+            cl_int ret = clSetKernelArg(k, n, sz, p);
+            if (ret != CL_SUCCESS)
+                throw clexception("clSetKernelArg", ret);
+            b.set = true;
+            b.local = local;
+            b.size = sz;
+            if (local)
+                b.bytes.clear();
+            else
+                b.bytes.assign(static_cast<const char*>(p), sz);
         }
     };
 
 
     struct program {
         cl_program p;
+        std::map<std::string, std::unique_ptr<kernel>> kernels;    // see get_kernel
         program(cl_program p) : p(p) {}
+        program(const program&) = delete;
+        program(program&& x) : p(x.p), kernels(std::move(x.kernels)) {
+            x.p = NULL;
+        }
         ~program() {
-            clReleaseProgram(p);
+            kernels.clear();
+            if (p != NULL)
+                clReleaseProgram(p);
+        }
+
+        program& operator=(const program&) = delete;
+        program& operator=(program&& x) {
+            std::swap(p, x.p);
+            std::swap(kernels, x.kernels);
+            return *this;
         }
 
         cl_kernel create_kernel(const char* name) {
+            OCL_TRACE_SPAN("clCreateKernel", 0, name);
             cl_int ret = 0;
             cl_kernel k = clCreateKernel(p, name, &ret);
             if (ret != CL_SUCCESS)
                 throw clexception("clCreateKernel", ret);
             return k;
         }
-    };
 
-
-    struct mem_buffer {
-        cl_mem m;
-        mem_buffer(cl_mem m) : m(m) {}
-        ~mem_buffer() {
-            clReleaseMemObject(m);
+        // the kernel is created on the first call and kept with the program, so its
+        // bound arguments are kept between launches too
+        kernel& get_kernel(const std::string& name) {
+            auto& k = kernels[name];
+            if (!k)
+                k = std::make_unique<kernel>(create_kernel(name.c_str()));
+            return *k;
         }
     };
 }
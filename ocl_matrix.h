@@ -0,0 +1,161 @@
+#pragma once
+#include <cstddef>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <vector>
+
+namespace ocl {
+
+    // Allocator for std::vector which aligns the storage to Align bytes,
+    // so rows can be loaded with aligned SIMD instructions and pinned by the driver
+    template<typename T, size_t Align = 64>
+    struct aligned_allocator {
+        using value_type = T;
+
+        template<typename U>
+        struct rebind {
+            using other = aligned_allocator<U, Align>;
+        };
+
+        aligned_allocator() = default;
+
+        template<typename U>
+        aligned_allocator(const aligned_allocator<U, Align>&) {}
+
+        T* allocate(size_t n) {
+            return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t(Align)));
+        }
+
+        void deallocate(T* p, size_t) {
+            ::operator delete(p, std::align_val_t(Align));
+        }
+
+        template<typename U>
+        bool operator==(const aligned_allocator<U, Align>&) const { return true; }
+
+        template<typename U>
+        bool operator!=(const aligned_allocator<U, Align>&) const { return false; }
+    };
+
+
+    // Non-owning row-major view: element (i, j) is data[i * ld + j].
+    // T may be const.
+    template<typename T>
+    struct matrix_view {
+        using value_type = T;
+
+        T* data;
+        size_t rows;
+        size_t cols;
+        size_t ld;      // leading dimension (row stride) in elements, ld >= cols
+
+        matrix_view(T* data, size_t rows, size_t cols, size_t ld = 0)
+            : data(data), rows(rows), cols(cols), ld(ld ? ld : cols) {}
+
+        operator matrix_view<const T>() const {
+            return matrix_view<const T>(data, rows, cols, ld);
+        }
+
+        T* operator[](size_t i) const { return data + i * ld; }
+        T& operator()(size_t i, size_t j) const { return data[i * ld + j]; }
+
+        size_t size() const { return rows * cols; }
+
+        // rows are back to back, so the view can be moved as one block of memory
+        bool contiguous() const { return ld == cols || rows <= 1; }
+
+        matrix_view block(size_t row, size_t col, size_t nrows, size_t ncols) const {
+            if (row + nrows > rows || col + ncols > cols)
+                throw std::out_of_range("matrix_view::block: block is out of the matrix");
+            return matrix_view(data + row * ld + col, nrows, ncols, ld);
+        }
+
+        matrix_view row_range(size_t row, size_t nrows) const {
+            return block(row, 0, nrows, cols);
+        }
+    };
+
+
+    // Owning, contiguous, aligned row-major matrix
+    template<typename T>
+    struct matrix {
+        using value_type = T;
+
+        size_t rows = 0;
+        size_t cols = 0;
+        size_t ld = 0;
+        std::vector<T, aligned_allocator<T>> items;
+
+        matrix() {}
+
+        // ld > cols pads every row, e.g. to a multiple of the vector width
+        matrix(size_t rows, size_t cols, size_t ld = 0)
+            : rows(rows), cols(cols), ld(ld ? ld : cols), items(rows * (ld ? ld : cols)) {
+            if (this->ld < cols)
+                throw std::invalid_argument("matrix: leading dimension is less than the number of columns");
+        }
+
+        T* data() { return items.data(); }
+        const T* data() const { return items.data(); }
+
+        T* operator[](size_t i) { return data() + i * ld; }
+        const T* operator[](size_t i) const { return data() + i * ld; }
+
+        T& operator()(size_t i, size_t j) { return items[i * ld + j]; }
+        const T& operator()(size_t i, size_t j) const { return items[i * ld + j]; }
+
+        size_t size() const { return rows * cols; }
+
+        matrix_view<T> view() { return matrix_view<T>(data(), rows, cols, ld); }
+        matrix_view<const T> view() const { return matrix_view<const T>(data(), rows, cols, ld); }
+
+        operator matrix_view<T>() { return view(); }
+        operator matrix_view<const T>() const { return view(); }
+
+        matrix_view<T> block(size_t row, size_t col, size_t nrows, size_t ncols) {
+            return view().block(row, col, nrows, ncols);
+        }
+
+        matrix_view<const T> block(size_t row, size_t col, size_t nrows, size_t ncols) const {
+            return view().block(row, col, nrows, ncols);
+        }
+    };
+
+
+    // compares the elements only, padding and leading dimension do not matter
+    template<typename T, typename U>
+    bool equal(matrix_view<T> x, matrix_view<U> y) {
+        if (x.rows != y.rows || x.cols != y.cols)
+            return false;
+        for (size_t i = 0; i < x.rows; ++i)
+            for (size_t j = 0; j < x.cols; ++j)
+                if (x(i, j) != y(i, j))
+                    return false;
+        return true;
+    }
+
+    template<typename T>
+    bool operator==(const matrix<T>& x, const matrix<T>& y) {
+        return equal(x.view(), y.view());
+    }
+
+    template<typename T>
+    bool operator!=(const matrix<T>& x, const matrix<T>& y) {
+        return !(x == y);
+    }
+
+    // copies elements between views of the same shape
+    template<typename T, typename U>
+    void copy(matrix_view<T> src, matrix_view<U> dst) {
+        static_assert(sizeof(T) == sizeof(U), "copy: different element types");
+        if (src.rows != dst.rows || src.cols != dst.cols)
+            throw std::invalid_argument("copy: different matrix size");
+        if (src.contiguous() && dst.contiguous()) {
+            std::memcpy(dst.data, src.data, src.size() * sizeof(T));
+            return;
+        }
+        for (size_t i = 0; i < src.rows; ++i)
+            std::memcpy(dst[i], src[i], src.cols * sizeof(T));
+    }
+}
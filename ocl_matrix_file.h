@@ -0,0 +1,234 @@
+#pragma once
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <CL/cl.h>
+
+#include "ocl_error.h"
+#include "ocl_helpers.h"
+#include "ocl_matrix.h"
+#include "ocl_precision.h"
+
+namespace ocl {
+
+    // Binary matrix file: a 64 byte little-endian header, then the elements starting at
+    // `offset`, a multiple of the page size (at least 4096), so a mapping of the file gives
+    // a payload pointer aligned for CL_MEM_USE_HOST_PTR and DMA.
+    struct matrix_file_header {
+        char magic[8];          // "OCLMAT1\0"
+        uint32_t version;       // 1
+        uint32_t dtype;         // bits of the floating point element: 16, 32 or 64
+        uint32_t layout;        // row_major or column_major
+        uint32_t reserved;
+        uint64_t rows;
+        uint64_t cols;
+        uint64_t ld;            // elements from one stored row (column if column major) to the next
+        uint64_t offset;        // of the payload, bytes from the start of the file
+        uint64_t spare;         // 0
+    };
+
+    static_assert(sizeof(matrix_file_header) == 64, "matrix_file_header: must be 64 bytes");
+
+
+    // A matrix file mapped into memory. Opened files are mapped copy-on-write, so buffers
+    // made on the mapping with CL_MEM_USE_HOST_PTR never write into the file; created
+    // files are mapped shared, and what is stored in the mapping goes to the file.
+    //
+    // A column major file of B is B^T row major, which is what gemm takes as Bt:
+    // stored() returns the view in storage order for that.
+    struct matrix_file {
+        enum layout_type { row_major = 0, column_major = 1 };
+
+        std::string path;
+        matrix_file_header header = {};
+        char* base = NULL;          // the mapping of the whole file
+        size_t length = 0;
+        bool writable = false;
+
+        matrix_file() {}
+
+        // maps an existing file and checks its header
+        explicit matrix_file(const std::string& path) : path(path) {
+            const int fd = ::open(path.c_str(), O_RDONLY);
+            if (fd < 0)
+                throw std::system_error(errno, std::generic_category(), "matrix_file: open " + path);
+            struct stat st;
+            if (fstat(fd, &st) != 0) {
+                const int err = errno;
+                ::close(fd);
+                throw std::system_error(err, std::generic_category(), "matrix_file: stat " + path);
+            }
+            length = st.st_size;
+            if (length < sizeof(header)) {
+                ::close(fd);
+                throw std::runtime_error("matrix_file: " + path + " is too short");
+            }
+            map(fd, PROT_READ | PROT_WRITE, MAP_PRIVATE);
+            std::memcpy(&header, base, sizeof(header));
+            // the destructor does not run if the constructor throws
+            try {
+                check();
+            }
+            catch (...) {
+                close();
+                throw;
+            }
+            // read once front to back when uploaded
+            madvise(base, length, MADV_SEQUENTIAL);
+        }
+
+        matrix_file(const matrix_file&) = delete;
+        matrix_file(matrix_file&& x) : path(std::move(x.path)), header(x.header), base(x.base), length(x.length), writable(x.writable) {
+            x.base = NULL;
+            x.length = 0;
+        }
+
+        ~matrix_file() {
+            close();
+        }
+
+        matrix_file& operator=(const matrix_file&) = delete;
+        matrix_file& operator=(matrix_file&& x) {
+            std::swap(path, x.path);
+            std::swap(header, x.header);
+            std::swap(base, x.base);
+            std::swap(length, x.length);
+            std::swap(writable, x.writable);
+            return *this;
+        }
+
+        // Creates (or truncates) a rows x cols file of T and maps it shared, for results
+        // written in place, e.g. by read_buffer into data() or through a USE_HOST_PTR buffer
+        template<typename T>
+        static matrix_file create(const std::string& path, size_t rows, size_t cols, layout_type layout = row_major) {
+            matrix_file res;
+            res.path = path;
+            res.writable = true;
+
+            auto& h = res.header;
+            std::memcpy(h.magic, "OCLMAT1", 8);
+            h.version = 1;
+            h.dtype = precision<T>::bits;
+            h.layout = layout;
+            h.rows = rows;
+            h.cols = cols;
+            h.ld = (layout == row_major) ? cols : rows;
+            h.offset = alignment();
+            res.length = h.offset + rows * cols * sizeof(T);
+
+            const int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+            if (fd < 0)
+                throw std::system_error(errno, std::generic_category(), "matrix_file: create " + path);
+            if (ftruncate(fd, res.length) != 0) {
+                const int err = errno;
+                ::close(fd);
+                throw std::system_error(err, std::generic_category(), "matrix_file: resize " + path);
+            }
+            res.map(fd, PROT_READ | PROT_WRITE, MAP_SHARED);
+            std::memcpy(res.base, &h, sizeof(h));
+            return res;
+        }
+
+        // writes a matrix to a new row major file
+        template<typename T>
+        static void save(const std::string& path, matrix_view<const T> v) {
+            auto f = create<T>(path, v.rows, v.cols);
+            copy(v, f.template view<T>());
+            f.sync();
+        }
+
+        static size_t alignment() {
+            return std::max<size_t>(4096, sysconf(_SC_PAGESIZE));
+        }
+
+        size_t rows() const { return header.rows; }
+        size_t cols() const { return header.cols; }
+
+        size_t stored_rows() const { return header.layout == row_major ? header.rows : header.cols; }
+        size_t stored_cols() const { return header.layout == row_major ? header.cols : header.rows; }
+
+        void* data() const { return base + header.offset; }
+
+        // payload bytes, padding of the last stored row excluded
+        size_t bytes() const {
+            if (stored_rows() == 0)
+                return 0;
+            return ((stored_rows() - 1) * header.ld + stored_cols()) * (header.dtype / 8);
+        }
+
+        // elements in storage order: rows x cols, or cols x rows for a column major file
+        template<typename T>
+        matrix_view<T> stored() const {
+            if (header.dtype != precision<typename std::remove_const<T>::type>::bits)
+                throw std::invalid_argument("matrix_file: " + path + " holds " + std::to_string(header.dtype) + " bit elements");
+            return matrix_view<T>(static_cast<T*>(data()), stored_rows(), stored_cols(), header.ld);
+        }
+
+        // the matrix itself, only for row major files
+        template<typename T>
+        matrix_view<T> view() const {
+            if (header.layout != row_major)
+                throw std::invalid_argument("matrix_file: " + path + " is column major, see stored()");
+            return stored<T>();
+        }
+
+        // buffer on the mapping (CL_MEM_USE_HOST_PTR): the driver may read the pages in place
+        // instead of copying them, on devices sharing host memory it does not copy at all
+        cl_mem create_buffer(context& ctx, cl_mem_flags flags) const {
+            return ctx.create_buffer(flags | CL_MEM_USE_HOST_PTR, bytes(), data());
+        }
+
+        // For a buffer made by create_buffer on this file: once it is mapped for reading its
+        // contents are in the host memory it was made on, the file mapping here
+        void fetch(command_queue& q, cl_mem m) const {
+            q.map_buffer<char>(m, CL_MAP_READ, 0, bytes()).unmap();
+            q.finish();
+        }
+
+        // the mapping of a created file goes to disk
+        void sync() {
+            if (base != NULL && writable && msync(base, length, MS_SYNC) != 0)
+                throw std::system_error(errno, std::generic_category(), "matrix_file: msync " + path);
+        }
+
+        void close() {
+            if (base != NULL)
+                munmap(base, length);
+            base = NULL;
+            length = 0;
+        }
+
+        void map(int fd, int prot, int flags) {
+            void* p = mmap(NULL, length, prot, flags, fd, 0);
+            const int err = errno;
+            ::close(fd);
+            if (p == MAP_FAILED)
+                throw std::system_error(err, std::generic_category(), "matrix_file: mmap " + path);
+            base = static_cast<char*>(p);
+        }
+
+        void check() const {
+            const auto& h = header;
+            if (std::memcmp(h.magic, "OCLMAT1", 8) != 0 || h.version != 1)
+                throw std::runtime_error("matrix_file: " + path + " is not a matrix file");
+            if (h.dtype != 16 && h.dtype != 32 && h.dtype != 64)
+                throw std::runtime_error("matrix_file: " + path + ": unknown element type");
+            if (h.layout != row_major && h.layout != column_major)
+                throw std::runtime_error("matrix_file: " + path + ": unknown layout");
+            if (h.ld < stored_cols() || h.offset < sizeof(h) || h.offset > length || h.offset % (h.dtype / 8) != 0)
+                throw std::runtime_error("matrix_file: " + path + ": bad header");
+            // divided rather than multiplied, so a broken header cannot overflow the check
+            const uint64_t elements = (length - h.offset) / (h.dtype / 8);
+            if (stored_rows() != 0 && (h.ld == 0 || (elements < stored_cols() || (elements - stored_cols()) / h.ld < stored_rows() - 1)))
+                throw std::runtime_error("matrix_file: " + path + ": shorter than its header says");
+        }
+    };
+}
@@ -0,0 +1,144 @@
+#pragma once
+#include <algorithm>
+#include <memory>
+#include <ostream>
+#include <stdexcept>
+#include <vector>
+#include <CL/cl.h>
+
+#include "ocl_error.h"
+#include "ocl_device.h"
+#include "ocl_helpers.h"
+#include "ocl_matrix.h"
+#include "ocl_gemm.h"
+
+namespace ocl {
+
+    // One device of multi_device_gemm: own context, profiling queue, built kernel and buffers
+    struct gemm_worker {
+        device_description dd;
+        context ctx;
+        command_queue q;
+        sgemm gemm;
+        double throughput = 0;  // rows of C per ms on the last run, 0 until measured
+
+        std::unique_ptr<mem_buffer> a, bt, c;
+        size_t a_size = 0, bt_size = 0, c_size = 0;
+
+        gemm_worker(const device_description& dd, program_cache* cache = NULL, const tuning_table* tuning = NULL)
+            : dd(dd), ctx(dd.id, cache), q(ctx.create_queue(CL_QUEUE_PROFILING_ENABLE)), gemm(ctx, dd, 0, 0, 0, tuning) {}
+
+        // buffers only grow
+        void reserve(std::unique_ptr<mem_buffer>* m, size_t* current, cl_mem_flags flags, size_t sz) {
+            if (*current >= sz)
+                return;
+            m->reset();
+            *m = std::make_unique<mem_buffer>(ctx.create_buffer(flags, sz));
+            *current = sz;
+        }
+    };
+
+
+    // C = A * Bt^T spread over several devices.
+    //
+    // The rows of C are split between the devices in proportion to their throughput: the
+    // number of compute units before the first run, the measured rows per ms afterwards.
+    // Every device gets its slice of A and the whole Bt, all queues are flushed before
+    // any of them is waited for, so uploads and kernels of different devices overlap,
+    // and every device reads its rows straight into the output view.
+    struct multi_device_gemm {
+        std::vector<std::unique_ptr<gemm_worker>> workers;
+
+        multi_device_gemm(const std::vector<device_description>& devices, program_cache* cache = NULL,
+                          const tuning_table* tuning = NULL) {
+            for (const auto& dd : devices)
+                workers.push_back(std::make_unique<gemm_worker>(dd, cache, tuning));
+        }
+
+        // rows of C for every worker; every worker gets at least one row if there are enough,
+        // so all of them have a measured throughput after the first run
+        std::vector<size_t> split(size_t M) const {
+            if (workers.empty())
+                throw std::invalid_argument("multi_device_gemm: no devices");
+            const bool measured = std::all_of(workers.begin(), workers.end(), [](auto& w) { return w->throughput > 0; });
+
+            std::vector<double> weights;
+            double total = 0;
+            for (const auto& w : workers) {
+                weights.push_back(measured ? w->throughput : std::max<double>(w->dd.units, 1));
+                total += weights.back();
+            }
+
+            const size_t reserved = (M >= workers.size()) ? workers.size() : 0;
+            std::vector<size_t> rows(workers.size(), reserved ? 1 : 0);
+            size_t given = reserved;
+            for (size_t i = 0; i < workers.size(); ++i) {
+                const size_t r = static_cast<size_t>((M - reserved) * weights[i] / total);
+                rows[i] += r;
+                given += r;
+            }
+            // rounding leftovers go to the fastest device
+            const size_t fastest = std::max_element(weights.begin(), weights.end()) - weights.begin();
+            rows[fastest] += M - given;
+            return rows;
+        }
+
+        // a is M x K, bt is N x K, c is M x N
+        void run(matrix_view<const cl_float> a, matrix_view<const cl_float> bt, matrix_view<cl_float> c) {
+            if (a.cols != bt.cols || c.rows != a.rows || c.cols != bt.rows)
+                throw std::invalid_argument("multi_device_gemm::run: matrix sizes do not match");
+
+            const size_t N = bt.rows;
+            const size_t K = a.cols;
+            const auto rows = split(a.rows);
+
+            std::vector<event> first(workers.size());
+            std::vector<event> last(workers.size());
+
+            size_t row = 0;
+            for (size_t i = 0; i < workers.size(); ++i) {
+                auto& w = *workers[i];
+                if (rows[i] == 0)
+                    continue;
+
+                w.reserve(&w.a, &w.a_size, CL_MEM_READ_ONLY, rows[i] * K * sizeof(cl_float));
+                w.reserve(&w.bt, &w.bt_size, CL_MEM_READ_ONLY, N * K * sizeof(cl_float));
+                w.reserve(&w.c, &w.c_size, CL_MEM_WRITE_ONLY, rows[i] * N * sizeof(cl_float));
+
+                w.q.write_matrix(w.a->m, 0, a.row_range(row, rows[i]), false, &first[i].e);
+                w.q.write_matrix(w.bt->m, 0, bt, false);
+                w.gemm.run(w.q, rows[i], N, K, w.a->m, w.bt->m, w.c->m);
+                w.q.read_matrix(w.c->m, 0, c.row_range(row, rows[i]), false, &last[i].e);
+                clFlush(w.q.q);
+
+                row += rows[i];
+            }
+
+            for (size_t i = 0; i < workers.size(); ++i) {
+                auto& w = *workers[i];
+                if (rows[i] == 0)
+                    continue;
+
+                w.q.finish();
+                w.q.clear_commands();
+
+                const double ms = (last[i].profiling_info(CL_PROFILING_COMMAND_END)
+                                   - first[i].profiling_info(CL_PROFILING_COMMAND_START)) / 1e6;
+                if (ms > 0)
+                    w.throughput = rows[i] / ms;
+            }
+        }
+    };
+
+
+    std::ostream& operator<<(std::ostream& str, const multi_device_gemm& g) {
+        for (size_t i = 0; i < g.workers.size(); ++i) {
+            str << (i ? ", " : "") << g.workers[i]->dd.name << ": ";
+            if (g.workers[i]->throughput > 0)
+                str << g.workers[i]->throughput << " rows/ms";
+            else
+                str << "not measured";
+        }
+        return str;
+    }
+}
@@ -0,0 +1,200 @@
+#pragma once
+#include <algorithm>
+#include <map>
+#include <ostream>
+#include <vector>
+#include <CL/cl.h>
+
+#include "ocl_error.h"
+#include "ocl_trace.h"
+
+namespace ocl {
+
+    struct memory_pool;
+
+
+    // Buffer taken from a memory_pool, goes back to the pool on destruction
+    struct pooled_buffer {
+        memory_pool* pool;
+        cl_mem m;
+        size_t size;        // requested size
+        size_t capacity;    // size class, the real size of the buffer
+
+        pooled_buffer(memory_pool* pool, cl_mem m, size_t size, size_t capacity)
+            : pool(pool), m(m), size(size), capacity(capacity) {}
+        pooled_buffer(const pooled_buffer&) = delete;
+        pooled_buffer(pooled_buffer&& x) : pool(x.pool), m(x.m), size(x.size), capacity(x.capacity) {
+            x.m = NULL;
+        }
+        ~pooled_buffer();
+
+        pooled_buffer& operator=(const pooled_buffer&) = delete;
+        pooled_buffer& operator=(pooled_buffer&& x) {
+            std::swap(pool, x.pool);
+            std::swap(m, x.m);
+            std::swap(size, x.size);
+            std::swap(capacity, x.capacity);
+            return *this;
+        }
+    };
+
+
+    struct pool_stats {
+        size_t in_use = 0;          // bytes handed out (by size class)
+        size_t high_water = 0;      // maximum of in_use
+        size_t reserved = 0;        // bytes allocated from the driver: slabs and large buffers
+        size_t allocations = 0;     // allocate() calls
+        size_t reused = 0;          // allocate() calls served from a free list
+        size_t driver_allocations = 0;
+
+        // share of the reserved memory which is not handed out right now
+        double fragmentation() const {
+            return reserved ? 1.0 - double(in_use) / reserved : 0.0;
+        }
+    };
+
+
+    std::ostream& operator<<(std::ostream& str, const pool_stats& st) {
+        str << "in use " << st.in_use << ", high water " << st.high_water << ", reserved " << st.reserved
+            << ", fragmentation " << st.fragmentation() << ", allocations " << st.allocations
+            << " (" << st.reused << " reused, " << st.driver_allocations << " from the driver)";
+        return str;
+    }
+
+
+    // Pool of read-write device buffers for one context.
+    //
+    // Requests are rounded up to a size class (four classes per power of two) and freed
+    // buffers wait in a free list of their class for the next request of that class.
+    // Small classes are carved as sub-buffers out of large slabs, at offsets aligned to
+    // CL_DEVICE_MEM_BASE_ADDR_ALIGN; big ones get a buffer of their own.
+    // Slab space is never given back before the pool dies, only reused through free lists.
+    // Not thread-safe. All pooled_buffers must be destroyed before the pool.
+    struct memory_pool {
+        struct slab {
+            cl_mem m;
+            size_t size;
+            size_t used;
+        };
+
+        cl_context ctx;
+        size_t align;           // bytes
+        size_t slab_size;
+        size_t small_limit;     // classes up to this size are carved from slabs
+        std::vector<slab> slabs;
+        std::map<size_t, std::vector<cl_mem>> free_lists;
+        pool_stats stats;
+
+        memory_pool(cl_context ctx, cl_device_id did, size_t slab_size = 64 << 20) : ctx(ctx) {
+            cl_uint align_bits = 0;
+            cl_int ret = clGetDeviceInfo(did, CL_DEVICE_MEM_BASE_ADDR_ALIGN, sizeof(align_bits), &align_bits, NULL);
+            if (ret != CL_SUCCESS)
+                throw clexception("clGetDeviceInfo", ret);
+            align = std::max<size_t>(align_bits / 8, 1);
+
+            cl_ulong max_alloc = 0;
+            ret = clGetDeviceInfo(did, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(max_alloc), &max_alloc, NULL);
+            if (ret != CL_SUCCESS)
+                throw clexception("clGetDeviceInfo", ret);
+
+            this->slab_size = std::min<size_t>(slab_size, max_alloc);
+            small_limit = this->slab_size / 8;
+        }
+
+        memory_pool(const memory_pool&) = delete;
+        memory_pool& operator=(const memory_pool&) = delete;
+
+        ~memory_pool() {
+            // sub-buffers first, the slabs they point into after them
+            for (auto& fl : free_lists)
+                for (auto m : fl.second)
+                    clReleaseMemObject(m);
+            for (auto& s : slabs)
+                clReleaseMemObject(s.m);
+        }
+
+        // 256 bytes minimum, then 4 classes per power of two: 2^k, 1.25 * 2^k, 1.5 * 2^k, 1.75 * 2^k
+        static size_t size_class(size_t sz) {
+            size_t p = 256;
+            if (sz <= p)
+                return p;
+            while (p * 2 < sz)
+                p *= 2;
+            const size_t step = p / 4;
+            return (sz + step - 1) / step * step;
+        }
+
+        pooled_buffer allocate(size_t sz) {
+            const size_t c = size_class(sz);
+            stats.allocations += 1;
+
+            cl_mem m = NULL;
+            auto& fl = free_lists[c];
+            if (!fl.empty()) {
+                m = fl.back();
+                fl.pop_back();
+                stats.reused += 1;
+            }
+            else if (c <= small_limit) {
+                m = carve(c);
+            }
+            else {
+                m = create(c);
+                stats.reserved += c;
+            }
+
+            stats.in_use += c;
+            stats.high_water = std::max(stats.high_water, stats.in_use);
+            return pooled_buffer(this, m, sz, c);
+        }
+
+        void release(cl_mem m, size_t capacity) {
+            free_lists[capacity].push_back(m);
+            stats.in_use -= capacity;
+        }
+
+        // gives the free large buffers back to the driver; carved ones stay, their slabs are in use
+        void trim() {
+            for (auto& fl : free_lists) {
+                if (fl.first <= small_limit)
+                    continue;
+                for (auto m : fl.second)
+                    clReleaseMemObject(m);
+                stats.reserved -= fl.first * fl.second.size();
+                fl.second.clear();
+            }
+        }
+
+        cl_mem create(size_t sz) {
+            OCL_TRACE_SPAN("clCreateBuffer", sz, "pool");
+            cl_int ret = 0;
+            cl_mem m = clCreateBuffer(ctx, CL_MEM_READ_WRITE, sz, NULL, &ret);
+            if (ret != CL_SUCCESS)
+                throw clexception("clCreateBuffer", ret);
+            stats.driver_allocations += 1;
+            return m;
+        }
+
+        cl_mem carve(size_t c) {
+            if (slabs.empty() || slabs.back().used + c > slabs.back().size) {
+                slabs.push_back({create(slab_size), slab_size, 0});
+                stats.reserved += slab_size;
+            }
+
+            auto& s = slabs.back();
+            cl_buffer_region region = {s.used, c};
+            cl_int ret = 0;
+            cl_mem m = clCreateSubBuffer(s.m, CL_MEM_READ_WRITE, CL_BUFFER_CREATE_TYPE_REGION, &region, &ret);
+            if (ret != CL_SUCCESS)
+                throw clexception("clCreateSubBuffer", ret);
+            s.used += (c + align - 1) / align * align;
+            return m;
+        }
+    };
+
+
+    pooled_buffer::~pooled_buffer() {
+        if (m != NULL)
+            pool->release(m, capacity);
+    }
+}
@@ -0,0 +1,173 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <ostream>
+#include <CL/cl.h>
+
+#include "ocl_matrix.h"
+
+namespace ocl {
+
+    // IEEE 754 binary16 on the host, the layout of `half` in device memory. Only storage:
+    // arithmetic goes through float, as in kernels which load it with vload_half.
+    struct half {
+        cl_half bits = 0;
+
+        half() {}
+        half(float x) : bits(from_float(x)) {}
+
+        operator float() const {
+            return to_float(bits);
+        }
+
+        // round to nearest even, overflow goes to infinity
+        static cl_half from_float(float f) {
+            uint32_t x;
+            std::memcpy(&x, &f, sizeof(x));
+            const uint32_t sign = (x >> 16) & 0x8000;
+            const uint32_t abs = x & 0x7fffffff;
+
+            if (abs >= 0x7f800000)                          // inf, nan (kept quiet)
+                return cl_half(sign | 0x7c00 | (abs > 0x7f800000 ? 0x200 : 0));
+            if (abs >= 0x477ff000)                          // rounds to 65536 or more
+                return cl_half(sign | 0x7c00);
+            if (abs < 0x38800000) {                         // below the smallest normal half
+                if (abs < 0x33000000)                       // rounds to 0
+                    return cl_half(sign);
+                const uint32_t e = abs >> 23;
+                const uint32_t m = (abs & 0x7fffff) | 0x800000;
+                const uint32_t shift = 126 - e;             // 14..24
+                uint32_t h = m >> shift;
+                const uint32_t rest = m & ((1u << shift) - 1);
+                const uint32_t halfway = 1u << (shift - 1);
+                if (rest > halfway || (rest == halfway && (h & 1)))
+                    h += 1;
+                return cl_half(sign | h);
+            }
+            uint32_t h = ((abs - 0x38000000) >> 13);        // rebias the exponent 127 -> 15
+            const uint32_t rest = abs & 0x1fff;
+            if (rest > 0x1000 || (rest == 0x1000 && (h & 1)))
+                h += 1;                                     // may carry into the exponent, that is right
+            return cl_half(sign | h);
+        }
+
+        static float to_float(cl_half h) {
+            const uint32_t sign = uint32_t(h & 0x8000) << 16;
+            const uint32_t e = (h >> 10) & 0x1f;
+            uint32_t m = h & 0x3ff;
+            uint32_t x;
+
+            if (e == 0x1f)
+                x = sign | 0x7f800000 | (m << 13);
+            else if (e != 0)
+                x = sign | ((e + 112) << 23) | (m << 13);
+            else if (m == 0)
+                x = sign;
+            else {
+                // subnormal: normalize the mantissa
+                uint32_t ex = 113;
+                while (!(m & 0x400)) {
+                    m <<= 1;
+                    ex -= 1;
+                }
+                x = sign | (ex << 23) | ((m & 0x3ff) << 13);
+            }
+
+            float f;
+            std::memcpy(&f, &x, sizeof(f));
+            return f;
+        }
+    };
+
+    static_assert(sizeof(half) == sizeof(cl_half), "half: must have the device layout");
+
+
+    std::ostream& operator<<(std::ostream& str, half h) {
+        return str << float(h);
+    }
+
+
+    // Host element type -> the STORAGE / ACC value of the kernels (bits of the type)
+    template<typename T>
+    struct precision;
+
+    template<>
+    struct precision<half> {
+        static constexpr int bits = 16;
+        using accumulator = cl_float;   // half products summed in half lose too much
+        static const char* name() { return "half"; }
+    };
+
+    template<>
+    struct precision<cl_float> {
+        static constexpr int bits = 32;
+        using accumulator = cl_float;
+        static const char* name() { return "float"; }
+    };
+
+    template<>
+    struct precision<cl_double> {
+        static constexpr int bits = 64;
+        using accumulator = cl_double;
+        static const char* name() { return "double"; }
+    };
+
+
+    // element by element with conversion; copy() is for views of the same type
+    template<typename T, typename U>
+    void convert(matrix_view<T> src, matrix_view<U> dst) {
+        if (src.rows != dst.rows || src.cols != dst.cols)
+            throw std::invalid_argument("convert: different matrix size");
+        for (size_t i = 0; i < src.rows; ++i) {
+            auto s = src[i];
+            auto d = dst[i];
+            for (size_t j = 0; j < src.cols; ++j)
+                d[j] = U(s[j]);
+        }
+    }
+
+    template<typename U, typename T>
+    matrix<U> convert(const matrix<T>& src) {
+        matrix<U> res(src.rows, src.cols);
+        convert(src.view(), res.view());
+        return res;
+    }
+
+
+    // Element-wise conversions on the device, with the stream_pipeline contract:
+    // (__global const In*, __global Out*, int count). The double ones are only built
+    // when the device has cl_khr_fp64.
+    const char* precision_kernel_code = R"(
+__kernel void float_to_half(__global const float* in, __global half* out, int count)
+{
+    const int i = get_global_id(0);
+    if (i < count)
+        vstore_half_rte(in[i], i, out);
+}
+
+__kernel void half_to_float(__global const half* in, __global float* out, int count)
+{
+    const int i = get_global_id(0);
+    if (i < count)
+        out[i] = vload_half(i, in);
+}
+
+#ifdef cl_khr_fp64
+#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+
+__kernel void float_to_double(__global const float* in, __global double* out, int count)
+{
+    const int i = get_global_id(0);
+    if (i < count)
+        out[i] = in[i];
+}
+
+__kernel void double_to_float(__global const double* in, __global float* out, int count)
+{
+    const int i = get_global_id(0);
+    if (i < count)
+        out[i] = (float)in[i];
+}
+#endif
+)";
+}
@@ -0,0 +1,412 @@
+#pragma once
+#include <algorithm>
+#include <limits>
+#include <map>
+#include <memory>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <CL/cl.h>
+
+#include "ocl_error.h"
+#include "ocl_device.h"
+#include "ocl_helpers.h"
+
+namespace ocl {
+
+    // How two values combine, as an OpenCL C expression of a and b, and its identity.
+    // Reductions combine in no fixed order, so the operation must be associative and
+    // commutative there; scans keep the order and need only associativity.
+    struct combine_op {
+        std::string expr;
+        std::string identity;
+
+        template<typename T>
+        static combine_op sum() { return {"a + b", "0"}; }
+
+        template<typename T>
+        static combine_op min() { return {"min(a, b)", limit<T>(true)}; }
+
+        template<typename T>
+        static combine_op max() { return {"max(a, b)", limit<T>(false)}; }
+
+        // OpenCL C constant of the largest (or the lowest) value of T
+        template<typename T>
+        static std::string limit(bool largest) {
+            if (std::is_floating_point<T>::value)
+                return largest ? "INFINITY" : "-INFINITY";
+            // the names of OpenCL C, not derived from the type names: short is SHRT_MAX
+            static const char* names[2][2][4] = {
+                {{"CHAR_MIN", "SHRT_MIN", "INT_MIN", "LONG_MIN"}, {"CHAR_MAX", "SHRT_MAX", "INT_MAX", "LONG_MAX"}},
+                {{"0", "0", "0", "0"}, {"UCHAR_MAX", "USHRT_MAX", "UINT_MAX", "ULONG_MAX"}}};
+            const size_t i = (sizeof(T) == 1) ? 0 : (sizeof(T) == 2) ? 1 : (sizeof(T) == 4) ? 2 : 3;
+            return names[std::is_unsigned<T>::value][largest][i];
+        }
+    };
+
+
+    template<typename T>
+    struct indexed_value {
+        T value;
+        cl_long index;      // -1 if there were no elements
+    };
+
+
+    // Element-wise difference of two arrays: the largest absolute difference, where it is,
+    // and the largest distance in units in the last place
+    template<typename T>
+    struct compare_result {
+        T max_abs;
+        cl_long index;      // of max_abs, -1 if there were no elements
+        cl_ulong max_ulp;
+    };
+
+
+    template<typename T>
+    std::ostream& operator<<(std::ostream& str, const compare_result<T>& r) {
+        str << r.max_abs << " (" << r.max_ulp << " ulp) at element " << r.index;
+        return str;
+    }
+
+
+    // Prepended per program: T, COMBINE(a, b) and IDENTITY; BITS, AS_BITS and BITS_MIN
+    // for floating point T, for the ULP distance
+    const char* primitives_kernel_code = R"(
+#ifdef cl_khr_fp64
+#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+#endif
+
+// v, k take w, j if COMBINE picks w over v; on a tie the smaller index wins, -1 is no index
+#define ARG_COMBINE(v, k, w, j) \
+    if ((j) >= 0 && ((k) < 0 || (COMBINE(v, w) == (w) && ((w) != (v) || (j) < (k))))) { v = (w); k = (j); }
+
+// Every work-group combines a grid-stride share of in into out[group]; the work-group size
+// is a power of two. A second launch with one work-group combines the partial results.
+__kernel void reduce(ulong n, __global const T* in, __global T* out, __local T* tmp)
+{
+    const int lid = get_local_id(0);
+    T acc = IDENTITY;
+    for (ulong i = get_global_id(0); i < n; i += get_global_size(0))
+        acc = COMBINE(acc, in[i]);
+    tmp[lid] = acc;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (int s = get_local_size(0) / 2; s > 0; s >>= 1) {
+        if (lid < s)
+            tmp[lid] = COMBINE(tmp[lid], tmp[lid + s]);
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+    if (lid == 0)
+        out[get_group_id(0)] = tmp[0];
+}
+
+// reduce with the index of the value kept; in_index is NULL on the first pass
+__kernel void arg_reduce(ulong n, __global const T* in, __global const long* in_index, __global T* out, __global long* out_index,
+                         __local T* tmp, __local long* tmp_index)
+{
+    const int lid = get_local_id(0);
+    T v = IDENTITY;
+    long k = -1;
+    for (ulong i = get_global_id(0); i < n; i += get_global_size(0)) {
+        const T w = in[i];
+        const long j = in_index ? in_index[i] : (long)i;
+        ARG_COMBINE(v, k, w, j);
+    }
+    tmp[lid] = v;
+    tmp_index[lid] = k;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (int s = get_local_size(0) / 2; s > 0; s >>= 1) {
+        if (lid < s) {
+            const T w = tmp[lid + s];
+            const long j = tmp_index[lid + s];
+            ARG_COMBINE(v, k, w, j);
+            tmp[lid] = v;
+            tmp_index[lid] = k;
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+    if (lid == 0) {
+        out[get_group_id(0)] = v;
+        out_index[get_group_id(0)] = k;
+    }
+}
+
+// Scan of every block of get_local_size(0) elements in local memory; the block totals go
+// to sums (if not NULL), whose exclusive scan scan_add then combines into the blocks
+__kernel void scan_blocks(ulong n, int exclusive, __global const T* in, __global T* out, __global T* sums, __local T* tmp)
+{
+    const int lid = get_local_id(0);
+    const int size = get_local_size(0);
+    const ulong i = get_global_id(0);
+    tmp[lid] = i < n ? in[i] : IDENTITY;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (int s = 1; s < size; s <<= 1) {
+        const T x = lid >= s ? tmp[lid - s] : IDENTITY;
+        barrier(CLK_LOCAL_MEM_FENCE);
+        if (lid >= s)
+            tmp[lid] = COMBINE(x, tmp[lid]);
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+    if (i < n)
+        out[i] = exclusive ? (lid > 0 ? tmp[lid - 1] : IDENTITY) : tmp[lid];
+    if (sums && lid == size - 1)
+        sums[get_group_id(0)] = tmp[lid];
+}
+
+__kernel void scan_add(ulong n, __global T* out, __global const T* offsets)
+{
+    const ulong i = get_global_id(0);
+    if (i < n)
+        out[i] = COMBINE(offsets[get_group_id(0)], out[i]);
+}
+
+#ifdef BITS
+// the number of representable values from x to y, through integers ordered like the floats
+ulong ulp_distance(T x, T y)
+{
+    BITS a = AS_BITS(x);
+    BITS b = AS_BITS(y);
+    a = a < 0 ? BITS_MIN - a : a;
+    b = b < 0 ? BITS_MIN - b : b;
+    return a > b ? (ulong)a - (ulong)b : (ulong)b - (ulong)a;
+}
+
+#define MAX_COMBINE(m, k, u, m2, k2, u2) do { \
+        if ((k2) >= 0 && ((k) < 0 || (m2) > (m) || ((m2) == (m) && (k2) < (k)))) { m = (m2); k = (k2); } \
+        u = max(u, (u2)); \
+    } while (0)
+
+void compare_group(T m, long k, ulong u, __local T* tm, __local long* tk, __local ulong* tu,
+                   __global T* om, __global long* ok, __global ulong* ou)
+{
+    const int lid = get_local_id(0);
+    tm[lid] = m;
+    tk[lid] = k;
+    tu[lid] = u;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (int s = get_local_size(0) / 2; s > 0; s >>= 1) {
+        if (lid < s) {
+            MAX_COMBINE(m, k, u, tm[lid + s], tk[lid + s], tu[lid + s]);
+            tm[lid] = m;
+            tk[lid] = k;
+            tu[lid] = u;
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+    if (lid == 0) {
+        om[get_group_id(0)] = m;
+        ok[get_group_id(0)] = k;
+        ou[get_group_id(0)] = u;
+    }
+}
+
+// |x[i] - y[i]| and its ULPs, reduced to the largest per work-group; a NaN against a number
+// is an infinite difference, two NaNs are equal
+__kernel void compare(ulong n, __global const T* x, __global const T* y, __global T* out_abs, __global long* out_index,
+                      __global ulong* out_ulp, __local T* tmp_abs, __local long* tmp_index, __local ulong* tmp_ulp)
+{
+    T m = 0;
+    long k = -1;
+    ulong u = 0;
+    for (ulong i = get_global_id(0); i < n; i += get_global_size(0)) {
+        const T a = x[i];
+        const T b = y[i];
+        T d = 0;
+        ulong du = 0;
+        if (isnan(a) || isnan(b)) {
+            if (!(isnan(a) && isnan(b))) {
+                d = INFINITY;
+                du = ULONG_MAX;
+            }
+        }
+        else if (a != b) {
+            d = fabs(a - b);
+            du = ulp_distance(a, b);
+        }
+        MAX_COMBINE(m, k, u, d, (long)i, du);
+    }
+    compare_group(m, k, u, tmp_abs, tmp_index, tmp_ulp, out_abs, out_index, out_ulp);
+}
+
+// the per work-group results of compare, in place
+__kernel void compare_partials(ulong n, __global T* abs_io, __global long* index_io, __global ulong* ulp_io,
+                               __local T* tmp_abs, __local long* tmp_index, __local ulong* tmp_ulp)
+{
+    T m = 0;
+    long k = -1;
+    ulong u = 0;
+    for (ulong i = get_global_id(0); i < n; i += get_global_size(0))
+        MAX_COMBINE(m, k, u, abs_io[i], index_io[i], ulp_io[i]);
+    compare_group(m, k, u, tmp_abs, tmp_index, tmp_ulp, abs_io, index_io, ulp_io);
+}
+#endif
+)";
+
+
+    // Reductions, scans and comparisons of device buffers, which return one value to the
+    // host instead of the whole array. A program is built per element type and combine
+    // operation on first use and kept. Two launches at most per reduction: the first with
+    // up to `local` work-groups, the second with one over their partial results.
+    //
+    //     device_primitives prims(ctx, dd);
+    //     float s = prims.reduce<cl_float>(q, buf, n);
+    //     auto m = prims.arg_reduce<cl_float>(q, buf, n, combine_op::max<cl_float>());
+    //     auto d = prims.compare<cl_float>(q, result, reference, n);
+    //
+    // The launches and reads of one call share the partial buffers and are ordered only by
+    // the queue, so the queue must be in order; an out-of-order one is refused.
+    struct device_primitives {
+        context* ctx;
+        cl_device_id device;
+        bool fp64;
+        size_t local = 1;       // largest work-group size, a power of two
+        std::map<std::string, std::unique_ptr<program>> programs;
+        // partial results of the first pass, `local` elements of up to 8 bytes each
+        mem_buffer partial;
+        mem_buffer partial_index;
+        mem_buffer partial_ulp;
+
+        device_primitives(context& ctx, const device_description& dd)
+            : ctx(&ctx), device(dd.id), fp64(dd.fp64()) {
+            while (local * 2 <= std::min<size_t>(256, dd.max_work_group))
+                local *= 2;
+            partial = mem_buffer(ctx.create_buffer(CL_MEM_READ_WRITE, local * 8));
+            partial_index = mem_buffer(ctx.create_buffer(CL_MEM_READ_WRITE, local * sizeof(cl_long)));
+            partial_ulp = mem_buffer(ctx.create_buffer(CL_MEM_READ_WRITE, local * sizeof(cl_ulong)));
+        }
+
+        device_primitives(const device_primitives&) = delete;
+        device_primitives& operator=(const device_primitives&) = delete;
+
+        template<typename T>
+        program& program_for(const combine_op& op) {
+            static_assert(sizeof(T) <= 8, "device_primitives: elements of up to 8 bytes");
+            const char* type = cl_type_name<T>();
+            if (type == NULL)
+                throw std::invalid_argument("device_primitives: element type without an OpenCL C counterpart");
+            if (std::is_same<T, cl_double>::value && !fp64) {
+                clexception e(CL_INVALID_DEVICE);
+                e << "device_primitives: the device has no double precision support";
+                throw e;
+            }
+
+            const std::string key = std::string(type) + "|" + op.expr + "|" + op.identity;
+            auto& p = programs[key];
+            if (!p) {
+                std::string code = std::string("#define T ") + type + "\n"
+                    + "#define COMBINE(a, b) (" + op.expr + ")\n"
+                    + "#define IDENTITY (" + op.identity + ")\n";
+                if (std::is_same<T, cl_float>::value)
+                    code += "#define BITS int\n#define AS_BITS as_int\n#define BITS_MIN INT_MIN\n";
+                if (std::is_same<T, cl_double>::value)
+                    code += "#define BITS long\n#define AS_BITS as_long\n#define BITS_MIN LONG_MIN\n";
+                code += primitives_kernel_code;
+                p = std::make_unique<program>(ctx->create_program(code.c_str()));
+            }
+            return *p;
+        }
+
+        // the work-group size for k: `local`, halved while the kernel cannot take it
+        size_t group_size(kernel& k) {
+            const size_t max = k.work_group_size(device);
+            size_t l = local;
+            while (l > 1 && l > max)
+                l /= 2;
+            return l;
+        }
+
+        static void check_queue(const command_queue& q, const char* what) {
+            if (q.out_of_order)
+                throw std::invalid_argument(std::string("device_primitives::") + what + ": needs an in-order queue");
+        }
+
+        size_t groups_for(size_t n, size_t l) const {
+            return std::max<size_t>(1, std::min(l, (n + l - 1) / l));
+        }
+
+        // in[0] op in[1] op ... op in[n - 1], the identity if n is 0
+        template<typename T>
+        T reduce(command_queue& q, cl_mem in, size_t n, const combine_op& op = combine_op::sum<T>()) {
+            check_queue(q, "reduce");
+            kernel& k = program_for<T>(op).get_kernel("reduce");
+            const size_t l = group_size(k);
+            const size_t groups = groups_for(n, l);
+            k(q, nd_range(groups * l).with_local(l), cl_ulong(n), in, partial, local_memory{l * sizeof(T)});
+            if (groups > 1)
+                k(q, nd_range(l).with_local(l), cl_ulong(groups), partial, partial, local_memory{l * sizeof(T)});
+
+            T res;
+            q.read_buffer(partial.m, 0, &res, sizeof(T));
+            return res;
+        }
+
+        // the value op picks (op is min or max) and its first index
+        template<typename T>
+        indexed_value<T> arg_reduce(command_queue& q, cl_mem in, size_t n, const combine_op& op) {
+            check_queue(q, "arg_reduce");
+            kernel& k = program_for<T>(op).get_kernel("arg_reduce");
+            const size_t l = group_size(k);
+            const size_t groups = groups_for(n, l);
+            const local_memory values{l * sizeof(T)}, indices{l * sizeof(cl_long)};
+            k(q, nd_range(groups * l).with_local(l), cl_ulong(n), in, cl_mem(NULL), partial, partial_index, values, indices);
+            if (groups > 1)
+                k(q, nd_range(l).with_local(l), cl_ulong(groups), partial, partial_index, partial, partial_index, values, indices);
+
+            // the blocking read after it also waits for this one, the queue is in order
+            indexed_value<T> res;
+            q.read_buffer(partial.m, 0, &res.value, sizeof(T), false);
+            q.read_buffer(partial_index.m, 0, &res.index, sizeof(cl_long));
+            return res;
+        }
+
+        // out[i] = in[0] op ... op in[i], or with exclusive in[0] op ... op in[i - 1] and the
+        // identity for out[0]; out may be in. Block totals take a temporary buffer per level.
+        template<typename T>
+        void scan(command_queue& q, cl_mem in, cl_mem out, size_t n, bool exclusive = false, const combine_op& op = combine_op::sum<T>()) {
+            check_queue(q, "scan");
+            if (n == 0)
+                return;
+            program& p = program_for<T>(op);
+            kernel& k = p.get_kernel("scan_blocks");
+            const size_t l = std::min(group_size(k), group_size(p.get_kernel("scan_add")));
+            const size_t blocks = (n + l - 1) / l;
+            if (blocks == 1) {
+                k(q, nd_range(l).with_local(l), cl_ulong(n), cl_int(exclusive), in, out, cl_mem(NULL), local_memory{l * sizeof(T)});
+                return;
+            }
+
+            mem_buffer sums(ctx->create_buffer(CL_MEM_READ_WRITE, blocks * sizeof(T)));
+            k(q, nd_range(blocks * l).with_local(l), cl_ulong(n), cl_int(exclusive), in, out, sums, local_memory{l * sizeof(T)});
+            scan<T>(q, sums.m, sums.m, blocks, true, op);
+            p.get_kernel("scan_add")(q, nd_range(blocks * l).with_local(l), cl_ulong(n), out, sums);
+        }
+
+        // x against y, n elements each, in one pass over both
+        template<typename T>
+        compare_result<T> compare(command_queue& q, cl_mem x, cl_mem y, size_t n) {
+            static_assert(std::is_same<T, cl_float>::value || std::is_same<T, cl_double>::value,
+                          "device_primitives::compare: cl_float or cl_double elements");
+            check_queue(q, "compare");
+            program& p = program_for<T>(combine_op::sum<T>());
+            kernel& k = p.get_kernel("compare");
+            kernel& kp = p.get_kernel("compare_partials");
+            const size_t l = std::min(group_size(k), group_size(kp));
+            const size_t groups = groups_for(n, l);
+            const local_memory values{l * sizeof(T)}, indices{l * sizeof(cl_long)}, ulps{l * sizeof(cl_ulong)};
+            k(q, nd_range(groups * l).with_local(l), cl_ulong(n), x, y, partial, partial_index, partial_ulp, values, indices, ulps);
+            if (groups > 1)
+                kp(q, nd_range(l).with_local(l), cl_ulong(groups), partial, partial_index, partial_ulp, values, indices, ulps);
+
+            // the last read is blocking and waits for the others, the queue is in order
+            compare_result<T> res;
+            q.read_buffer(partial.m, 0, &res.max_abs, sizeof(T), false);
+            q.read_buffer(partial_index.m, 0, &res.index, sizeof(cl_long), false);
+            q.read_buffer(partial_ulp.m, 0, &res.max_ulp, sizeof(cl_ulong));
+            return res;
+        }
+    };
+}
@@ -0,0 +1,143 @@
+#pragma once
+#include <algorithm>
+#include <map>
+#include <ostream>
+#include <string>
+#include <vector>
+#include <CL/cl.h>
+
+#include "ocl_error.h"
+#include "ocl_helpers.h"
+
+namespace ocl {
+
+    // Device timestamps of one command, nanoseconds
+    struct command_profile {
+        cl_command_type type;
+        std::string name;
+        size_t bytes;
+        cl_ulong queued;
+        cl_ulong submit;
+        cl_ulong start;
+        cl_ulong end;
+
+        bool is_transfer() const { return type != CL_COMMAND_NDRANGE_KERNEL; }
+        double wait_ms() const { return (submit - queued) / 1e6; }      // host side, before the driver took it
+        double launch_ms() const { return (start - submit) / 1e6; }     // submitted, but not started on the device
+        double exec_ms() const { return (end - start) / 1e6; }
+    };
+
+
+    // Commands with the same name taken together
+    struct command_stats {
+        cl_command_type type;
+        std::string name;
+        size_t count = 0;
+        size_t bytes = 0;
+        double exec_ms = 0;
+        double min_ms = 0;
+        double max_ms = 0;
+        double launch_ms = 0;
+
+        double avg_ms() const { return count ? exec_ms / count : 0; }
+        double gbps() const { return exec_ms > 0 ? bytes / exec_ms / 1e6 : 0; }
+    };
+
+
+    struct queue_profile {
+        std::vector<command_profile> commands;
+        std::vector<command_stats> stats;
+        double transfer_ms = 0;   // sum of the execution time of all transfers
+        double kernel_ms = 0;     // sum of the execution time of all kernels
+        double launch_ms = 0;     // sum of submit -> start gaps
+        double wall_ms = 0;       // first queued -> last end
+    };
+
+
+    // Waits for all commands recorded by the queue and collects their timestamps.
+    // The queue must be created with CL_QUEUE_PROFILING_ENABLE.
+    // If clear is true the recorded commands are dropped, so the next call reports only new ones.
+    queue_profile get_profile(command_queue& q, bool clear = true) {
+        if (!q.profiling)
+            throw clexception("get_profile", CL_PROFILING_INFO_NOT_AVAILABLE);
+
+        queue_profile res;
+
+        std::vector<cl_event> events;
+        for (const auto& c : q.commands)
+            events.push_back(c.e);
+        if (!events.empty()) {
+            OCL_TRACE_SPAN("clWaitForEvents", 0, "get_profile");
+            cl_int ret = clWaitForEvents(events.size(), &events[0]);
+            if (ret != CL_SUCCESS)
+                throw clexception("clWaitForEvents", ret);
+        }
+
+        std::map<std::string, command_stats> by_name;
+        cl_ulong first = 0;
+        cl_ulong last = 0;
+
+        for (const auto& c : q.commands) {
+            command_profile cp;
+            cp.type = c.type;
+            cp.name = c.name;
+            cp.bytes = c.bytes;
+            cp.queued = event::profiling_info(c.e, CL_PROFILING_COMMAND_QUEUED);
+            cp.submit = event::profiling_info(c.e, CL_PROFILING_COMMAND_SUBMIT);
+            cp.start = event::profiling_info(c.e, CL_PROFILING_COMMAND_START);
+            cp.end = event::profiling_info(c.e, CL_PROFILING_COMMAND_END);
+
+            if (res.commands.empty() || cp.queued < first)
+                first = cp.queued;
+            last = std::max(last, cp.end);
+
+            if (cp.is_transfer())
+                res.transfer_ms += cp.exec_ms();
+            else
+                res.kernel_ms += cp.exec_ms();
+            res.launch_ms += cp.launch_ms();
+
+            auto& st = by_name[c.name];
+            if (st.count == 0) {
+                st.type = c.type;
+                st.name = c.name;
+                st.min_ms = st.max_ms = cp.exec_ms();
+            }
+            st.count += 1;
+            st.bytes += c.bytes;
+            st.exec_ms += cp.exec_ms();
+            st.min_ms = std::min(st.min_ms, cp.exec_ms());
+            st.max_ms = std::max(st.max_ms, cp.exec_ms());
+            st.launch_ms += cp.launch_ms();
+
+            res.commands.push_back(cp);
+        }
+
+        res.wall_ms = (last - first) / 1e6;
+        for (auto& x : by_name)
+            res.stats.push_back(x.second);
+
+        if (clear)
+            q.clear_commands();
+        return res;
+    }
+
+
+    std::ostream& operator<<(std::ostream& str, const command_stats& st) {
+        str << st.name << ": " << st.count << " commands, " << st.exec_ms << " ms"
+            << " (avg " << st.avg_ms() << ", min " << st.min_ms << ", max " << st.max_ms << ")"
+            << ", launch " << st.launch_ms << " ms";
+        if (st.bytes)
+            str << ", " << st.bytes << " bytes, " << st.gbps() << " GB/s";
+        return str;
+    }
+
+
+    std::ostream& operator<<(std::ostream& str, const queue_profile& p) {
+        str << "wall " << p.wall_ms << " ms: kernels " << p.kernel_ms << " ms, transfers " << p.transfer_ms
+            << " ms, launch overhead " << p.launch_ms << " ms\n";
+        for (const auto& st : p.stats)
+            str << "  " << st << "\n";
+        return str;
+    }
+}
@@ -0,0 +1,122 @@
+#pragma once
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include <CL/cl.h>
+
+#include "ocl_error.h"
+#include "ocl_device.h"
+
+namespace ocl {
+
+    // On-disk cache of program binaries.
+    //
+    // An entry is keyed by device name, device and driver versions, build options and
+    // source hash. The file name is a hash of the key, and the full key is stored in the
+    // file too, so a hash collision reads as a miss instead of a wrong binary.
+    // I/O errors are never fatal: the caller just builds from source.
+    struct program_cache {
+        std::string dir;
+
+        program_cache(const std::string& dir = default_dir()) : dir(dir) {}
+
+        // $OCL_PROGRAM_CACHE_DIR, $XDG_CACHE_HOME/ocl-programs or ~/.cache/ocl-programs
+        static std::string default_dir() {
+            if (const char* d = std::getenv("OCL_PROGRAM_CACHE_DIR"))
+                return d;
+            if (const char* d = std::getenv("XDG_CACHE_HOME"))
+                return std::string(d) + "/ocl-programs";
+            if (const char* d = std::getenv("HOME"))
+                return std::string(d) + "/.cache/ocl-programs";
+            return "ocl-programs";
+        }
+
+        static uint64_t hash(const void* data, size_t sz, uint64_t h = 14695981039346656037ull) {
+            // FNV-1a
+            auto p = static_cast<const unsigned char*>(data);
+            for (size_t i = 0; i < sz; ++i) {
+                h ^= p[i];
+                h *= 1099511628211ull;
+            }
+            return h;
+        }
+
+        static std::string key(cl_device_id did, const char* code, const char* options) {
+            std::stringstream s;
+            s << "device: " << get_device_data<std::string>(did, CL_DEVICE_NAME) << "\n"
+              << "version: " << get_device_data<std::string>(did, CL_DEVICE_VERSION) << "\n"
+              << "driver: " << get_device_data<std::string>(did, CL_DRIVER_VERSION) << "\n"
+              << "options: " << (options ? options : "") << "\n"
+              << "source: " << std::hex << hash(code, std::strlen(code)) << std::dec
+              << " " << std::strlen(code) << "\n";
+            return s.str();
+        }
+
+        std::string path(const std::string& key) const {
+            std::stringstream s;
+            s << dir << "/" << std::hex << hash(key.data(), key.size()) << ".bin";
+            return s.str();
+        }
+
+        bool load(const std::string& key, std::vector<unsigned char>* binary) const {
+            std::ifstream f(path(key), std::ios::binary);
+            if (!f)
+                return false;
+
+            uint64_t key_size = 0;
+            f.read(reinterpret_cast<char*>(&key_size), sizeof(key_size));
+            if (!f || key_size != key.size())
+                return false;
+
+            std::string stored(key_size, '\0');
+            f.read(&stored[0], key_size);
+            if (!f || stored != key)
+                return false;
+
+            binary->assign(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+            return !binary->empty();
+        }
+
+        void store(const std::string& key, const std::vector<unsigned char>& binary) const {
+            if (binary.empty())
+                return;
+
+            std::error_code ec;
+            std::filesystem::create_directories(dir, ec);
+            if (ec)
+                return;
+
+            // write under a name unique to the process and thread and rename, so concurrent
+            // writers never see half a file
+            const auto p = path(key);
+            const auto tmp = p + "." + std::to_string(getpid()) + "." + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id())) + ".tmp";
+            {
+                std::ofstream f(tmp, std::ios::binary | std::ios::trunc);
+                const uint64_t key_size = key.size();
+                f.write(reinterpret_cast<const char*>(&key_size), sizeof(key_size));
+                f.write(key.data(), key.size());
+                f.write(reinterpret_cast<const char*>(binary.data()), binary.size());
+                if (!f) {
+                    f.close();
+                    std::remove(tmp.c_str());
+                    return;
+                }
+            }
+            std::filesystem::rename(tmp, p, ec);
+            if (ec)
+                std::remove(tmp.c_str());
+        }
+
+        void remove(const std::string& key) const {
+            std::remove(path(key).c_str());
+        }
+    };
+}
@@ -0,0 +1,246 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <CL/cl.h>
+
+#include "ocl_error.h"
+#include "ocl_device.h"
+#include "ocl_helpers.h"
+#include "ocl_gemm.h"
+#include "ocl_precision.h"
+#include "ocl_program_cache.h"
+#include "ocl_tuning_table.h"
+
+namespace ocl {
+
+    // One context on a device shared by any number of host threads:
+    //
+    //     shared_runtime rt(dev, 4, &cache, &tuning);
+    //     // on every thread
+    //     rt.multiply<cl_float>(M, N, K, a, bt, c);
+    //     rt.queue().finish();
+    //
+    // Every thread gets a queue of a fixed pool when it first calls in (round robin over
+    // the pool, so threads share queues when there are more threads than queues), and its
+    // own clones of the kernels it runs: OpenCL calls are thread-safe except setting the
+    // arguments of one cl_kernel from several threads. Programs and gemm objects are built
+    // once, by the first thread asking for them, and then shared.
+    //
+    // The submission path takes no lock once a thread has made its first call and looked up
+    // the program or gemm: queue(), get_program(), gemm_for(), get_kernel() and multiply()
+    // then find everything in the thread's own state, reached through a thread-local table.
+    //
+    // A thread's state (its kernel clones) is dropped when the thread exits, and a thread
+    // forgets runtimes destroyed meanwhile the next time it meets a new one, so neither
+    // grows with thread pools that churn or with runtimes made and destroyed over time.
+    //
+    // Queues shared by threads cannot record commands for get_profile(), so
+    // CL_QUEUE_PROFILING_ENABLE is refused; event::profiling_info still works with events
+    // taken from the commands. The tuning table is only read, when gemms are built.
+    struct shared_runtime {
+        // what a host thread uses; touched only by that thread after it is made
+        struct thread_state {
+            command_queue* queue;
+            std::map<std::pair<cl_program, std::string>, std::unique_ptr<kernel>> kernels;
+            std::map<std::string, void*> objects;   // shared objects this thread has looked up
+        };
+
+        // runtimes alive in the process, for threads exiting after a runtime they used is gone
+        struct live_runtimes {
+            std::mutex mtx;
+            std::map<uint64_t, shared_runtime*> runtimes;
+
+            static live_runtimes& get() {
+                static live_runtimes r;
+                return r;
+            }
+        };
+
+        // The runtimes a thread has called, one per thread; on exit it drops the thread's
+        // state in those still alive.
+        struct thread_registration {
+            std::vector<std::pair<uint64_t, thread_state*>> known;
+
+            ~thread_registration() {
+                auto& live = live_runtimes::get();
+                std::lock_guard<std::mutex> lk(live.mtx);
+                for (const auto& k : known) {
+                    auto it = live.runtimes.find(k.first);
+                    if (it != live.runtimes.end())
+                        it->second->forget(std::this_thread::get_id());
+                }
+            }
+
+            // entries of destroyed runtimes
+            void prune() {
+                auto& live = live_runtimes::get();
+                std::lock_guard<std::mutex> lk(live.mtx);
+                known.erase(std::remove_if(known.begin(), known.end(),
+                                           [&](const auto& k) { return live.runtimes.count(k.first) == 0; }),
+                            known.end());
+            }
+        };
+
+        // built once by call_once, also when several threads ask at the same time
+        struct shared_entry {
+            std::once_flag once;
+            std::shared_ptr<void> value;
+        };
+
+        device_description dd;
+        context ctx;
+        tuning_table* tuning;
+        const uint64_t id;      // never reused, so thread-local entries of a destroyed runtime are never found
+        std::vector<std::unique_ptr<command_queue>> queues;     // fixed after construction
+        std::atomic<size_t> next_queue{0};
+        std::shared_mutex mtx;  // objects and threads
+        std::map<std::string, std::unique_ptr<shared_entry>> objects;  // programs and gemms by key
+        std::map<std::thread::id, std::unique_ptr<thread_state>> threads;
+
+        // queue_count 0 is a queue per hardware thread, at most 8
+        shared_runtime(const device_description& dd, size_t queue_count = 0, program_cache* cache = NULL,
+                       tuning_table* tuning = NULL, cl_command_queue_properties properties = 0)
+            : dd(dd), ctx(dd.id, cache), tuning(tuning), id(new_id()) {
+            if (properties & CL_QUEUE_PROFILING_ENABLE)
+                throw std::invalid_argument("shared_runtime: queues are shared between threads and cannot record commands for profiling");
+            if (queue_count == 0)
+                queue_count = std::max<size_t>(1, std::min<size_t>(8, std::thread::hardware_concurrency()));
+            for (size_t i = 0; i < queue_count; ++i)
+                queues.push_back(std::make_unique<command_queue>(ctx.create_queue(properties)));
+
+            auto& live = live_runtimes::get();
+            std::lock_guard<std::mutex> lk(live.mtx);
+            live.runtimes[id] = this;
+        }
+
+        // Threads still using the runtime must be done with it; exiting threads are held off
+        // until it is out of the live set.
+        ~shared_runtime() {
+            auto& live = live_runtimes::get();
+            std::lock_guard<std::mutex> lk(live.mtx);
+            live.runtimes.erase(id);
+        }
+
+        shared_runtime(const shared_runtime&) = delete;
+        shared_runtime& operator=(const shared_runtime&) = delete;
+
+        static uint64_t new_id() {
+            static std::atomic<uint64_t> last{0};
+            return ++last;
+        }
+
+        // the calling thread's state, registered on its first call
+        thread_state& local() {
+            static thread_local thread_registration reg;
+            for (const auto& k : reg.known)
+                if (k.first == id)
+                    return *k.second;
+
+            reg.prune();
+            std::unique_lock<std::shared_mutex> lk(mtx);
+            auto& st = threads[std::this_thread::get_id()];
+            if (!st) {
+                st = std::make_unique<thread_state>();
+                st->queue = queues[next_queue++ % queues.size()].get();
+            }
+            reg.known.push_back({id, st.get()});
+            return *st;
+        }
+
+        // drops the state of an exiting thread, with its kernel clones
+        void forget(std::thread::id t) {
+            std::unique_ptr<thread_state> st;
+            std::unique_lock<std::shared_mutex> lk(mtx);
+            auto it = threads.find(t);
+            if (it == threads.end())
+                return;
+            st = std::move(it->second);
+            threads.erase(it);
+        }
+
+        // the calling thread's queue
+        command_queue& queue() {
+            return *local().queue;
+        }
+
+        // the next queue of the pool, for work which may go to any queue; the caller must not
+        // wait for it through finish() of its own queue
+        command_queue& next() {
+            return *queues[next_queue++ % queues.size()];
+        }
+
+        void finish() {
+            for (auto& q : queues)
+                q->finish();
+        }
+
+        // the object made by make() for key, made once
+        template<typename T, typename Make>
+        T& shared(const std::string& key, Make make) {
+            void*& mine = local().objects[key];
+            if (mine != NULL)
+                return *static_cast<T*>(mine);
+
+            shared_entry* e = NULL;
+            {
+                std::shared_lock<std::shared_mutex> lk(mtx);
+                auto it = objects.find(key);
+                if (it != objects.end())
+                    e = it->second.get();
+            }
+            if (e == NULL) {
+                std::unique_lock<std::shared_mutex> lk(mtx);
+                auto& p = objects[key];
+                if (!p)
+                    p = std::make_unique<shared_entry>();
+                e = p.get();
+            }
+            // a failed make() leaves the entry empty, the next call tries again
+            std::call_once(e->once, [&] { e->value = make(); });
+            mine = e->value.get();
+            return *static_cast<T*>(mine);
+        }
+
+        program& get_program(const char* code, const std::string& options = std::string()) {
+            const std::string key = "program " + std::to_string(program_cache::hash(code, std::strlen(code))) + " " + options;
+            return shared<program>(key, [&] {
+                return std::make_shared<program>(ctx.create_program(code, options.c_str()));
+            });
+        }
+
+        // the calling thread's clone of kernel name of p
+        kernel& get_kernel(program& p, const std::string& name) {
+            auto& k = local().kernels[{p.p, name}];
+            if (!k)
+                k = std::make_unique<kernel>(p.create_kernel(name.c_str()));
+            return *k;
+        }
+
+        // Built once per precision and tuning bucket of the shape, like session::gemm_for. Its
+        // own kernels are not thread-safe; multiply() runs clones of them.
+        template<typename Storage>
+        gemm<Storage>& gemm_for(size_t M, size_t N, size_t K) {
+            const std::string key = std::string("gemm ") + precision<Storage>::name() + "/" + tuning_table::bucket(gemm_shape(M, N, K));
+            return shared<gemm<Storage>>(key, [&] {
+                return std::make_shared<gemm<Storage>>(ctx, dd, M, N, K, tuning);
+            });
+        }
+
+        // C = A * Bt^T on the calling thread's queue; a is M x K, bt is N x K, c is M x N
+        template<typename Storage>
+        void multiply(int M, int N, int K, cl_mem a, cl_mem bt, cl_mem c) {
+            gemm<Storage>& g = gemm_for<Storage>(M, N, K);
+            get_kernel(*g.p, "sgemm_nt")(queue(), g.range(M, N, 1), M, N, K, a, bt, c);
+        }
+    };
+}
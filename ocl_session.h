@@ -0,0 +1,122 @@
+#pragma once
+#include <map>
+#include <memory>
+#include <string>
+#include <typeinfo>
+#include <vector>
+#include <CL/cl.h>
+
+#include "ocl_error.h"
+#include "ocl_device.h"
+#include "ocl_helpers.h"
+#include "ocl_gemm.h"
+#include "ocl_matrix.h"
+#include "ocl_precision.h"
+#include "ocl_primitives.h"
+#include "ocl_tuning_table.h"
+
+namespace ocl {
+
+    // Everything needed to run on one device, kept warm between calls: the context, a
+    // queue, the gemm kernels built so far, the device primitives and the device buffers
+    // of the last problems.
+    //
+    //     session s(dev, &cache, &tuning);
+    //     for (...)
+    //         s.multiply(a, bt, c);   // the first call builds, the later ones only transfer and run
+    //
+    // Buffers are named and grow only when a bigger problem arrives, so a stream of
+    // problems of the same or decreasing size allocates nothing after the first one.
+    // Programs, kernels and buffers live as long as the session; it is neither copied nor
+    // moved, since the objects it made refer to its context.
+    struct session {
+        device_description dd;
+        context ctx;
+        command_queue queue;
+        tuning_table* tuning;
+        std::map<std::string, mem_buffer> buffers;
+        std::map<std::string, size_t> buffer_sizes;
+        std::map<std::string, std::shared_ptr<void>> gemms;    // gemm<T> by precision and shape bucket
+        std::unique_ptr<device_primitives> prims;               // see primitives()
+
+        session(const device_description& dd, program_cache* cache = NULL, tuning_table* tuning = NULL,
+                cl_command_queue_properties properties = 0)
+            : dd(dd), ctx(dd.id, cache), queue(ctx.create_queue(properties)), tuning(tuning) {
+            queue.tuning = tuning;
+        }
+
+        session(const session&) = delete;
+        session& operator=(const session&) = delete;
+
+        // Buffer `name` of at least bytes; reallocated (contents lost) only if it is smaller.
+        // The handle stays valid until a later call asks for more. Made with
+        // create_mapped_buffer, so on a host_unified device matrices go in and out of it
+        // through a mapping instead of a driver copy.
+        cl_mem buffer(const std::string& name, size_t bytes, cl_mem_flags flags = CL_MEM_READ_WRITE) {
+            auto& sz = buffer_sizes[name];
+            auto& b = buffers[name];
+            if (b.m == NULL || sz < bytes) {
+                b = mem_buffer();
+                b = mem_buffer(ctx.create_mapped_buffer(flags, bytes));
+                sz = bytes;
+            }
+            return b.m;
+        }
+
+        // reductions, scans and comparisons on the session's context, made on first use
+        device_primitives& primitives() {
+            if (!prims)
+                prims = std::make_unique<device_primitives>(ctx, dd);
+            return *prims;
+        }
+
+        // memory of all buffers back to the driver
+        void release_buffers() {
+            buffers.clear();
+            buffer_sizes.clear();
+        }
+
+        // Built once per precision and tuning bucket of the shape (see tuning_table::bucket),
+        // with the tuned configuration if the tuning table has one
+        template<typename Storage>
+        gemm<Storage>& gemm_for(size_t M, size_t N, size_t K) {
+            const std::string key = std::string(precision<Storage>::name()) + "/" + tuning_table::bucket(gemm_shape(M, N, K));
+            auto& g = gemms[key];
+            if (!g)
+                g = std::make_shared<gemm<Storage>>(ctx, dd, M, N, K, tuning);
+            return *static_cast<gemm<Storage>*>(g.get());
+        }
+
+        // C = A * Bt^T on data already on the device; a is M x K, bt is N x K, c is M x N
+        template<typename Storage>
+        void multiply(int M, int N, int K, cl_mem a, cl_mem bt, cl_mem c) {
+            gemm_for<Storage>(M, N, K).run(queue, M, N, K, a, bt, c);
+        }
+
+        // C = A * Bt^T on host matrices: uploads into the session buffers "a" and "bt", runs
+        // and downloads from "c", which keeps the result for later kernels. Waits for the result.
+        template<typename Storage>
+        void multiply(matrix_view<const Storage> a, matrix_view<const Storage> bt, matrix_view<Storage> c) {
+            if (a.cols != bt.cols || c.rows != a.rows || c.cols != bt.rows)
+                throw std::invalid_argument("session::multiply: matrix sizes do not match");
+            const int M = a.rows, N = bt.rows, K = a.cols;
+
+            cl_mem a_mem = buffer("a", a.size() * sizeof(Storage), CL_MEM_READ_ONLY);
+            cl_mem bt_mem = buffer("bt", bt.size() * sizeof(Storage), CL_MEM_READ_ONLY);
+            cl_mem c_mem = buffer("c", c.size() * sizeof(Storage));
+
+            // blocking transfers: on a host_unified device they go through a mapping, no copy
+            // by the driver, and the caller waits for the result anyway
+            queue.write_buffer(a_mem, a);
+            queue.write_buffer(bt_mem, bt);
+            multiply<Storage>(M, N, K, a_mem, bt_mem, c_mem);
+            queue.read_buffer(c_mem, c);
+            queue.finish();
+        }
+
+        template<typename Storage>
+        void multiply(const matrix<Storage>& a, const matrix<Storage>& bt, matrix<Storage>& c) {
+            multiply<Storage>(a.view(), bt.view(), c.view());
+        }
+    };
+}
@@ -0,0 +1,444 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <CL/cl.h>
+
+#include "ocl_error.h"
+#include "ocl_device.h"
+#include "ocl_helpers.h"
+#include "ocl_matrix.h"
+#include "ocl_precision.h"
+
+namespace ocl {
+
+    template<typename T>
+    struct coo_entry {
+        cl_int row;
+        cl_int col;
+        T value;
+    };
+
+
+    // Row lengths of a sparse matrix, what the SpMV strategy is chosen by
+    struct sparse_row_stats {
+        size_t rows = 0;
+        size_t nnz = 0;
+        size_t max = 0;
+        size_t empty = 0;
+        double mean = 0;
+        double stddev = 0;
+
+        // spread of the row lengths relative to their mean
+        double variation() const { return mean > 0 ? stddev / mean : 0; }
+    };
+
+
+    std::ostream& operator<<(std::ostream& str, const sparse_row_stats& st) {
+        str << st.rows << " rows, " << st.nnz << " nonzeros, " << st.mean << " per row (max " << st.max
+            << ", stddev " << st.stddev << ", " << st.empty << " empty)";
+        return str;
+    }
+
+
+    // Compressed sparse rows: the nonzeros of row r are values[row_ptr[r] .. row_ptr[r + 1])
+    // in columns col[...], sorted by column. Indices are cl_int, so at most 2^31 - 1 nonzeros.
+    template<typename T>
+    struct csr_matrix {
+        size_t rows = 0;
+        size_t cols = 0;
+        std::vector<cl_int> row_ptr = {0};
+        std::vector<cl_int> col;
+        std::vector<T> values;
+
+        size_t nnz() const { return values.size(); }
+
+        size_t bytes() const {
+            return row_ptr.size() * sizeof(cl_int) + col.size() * sizeof(cl_int) + values.size() * sizeof(T);
+        }
+
+        // the elements which are not 0
+        static csr_matrix from_dense(matrix_view<const T> m) {
+            csr_matrix res;
+            res.rows = m.rows;
+            res.cols = m.cols;
+            res.row_ptr.reserve(m.rows + 1);
+            for (size_t i = 0; i < m.rows; ++i) {
+                for (size_t j = 0; j < m.cols; ++j) {
+                    if (m(i, j) != T(0)) {
+                        res.col.push_back(cl_int(j));
+                        res.values.push_back(m(i, j));
+                    }
+                }
+                res.row_ptr.push_back(cl_int(res.values.size()));
+            }
+            return res;
+        }
+
+        // entries in any order; duplicates are summed
+        static csr_matrix from_coo(size_t rows, size_t cols, std::vector<coo_entry<T>> entries) {
+            std::sort(entries.begin(), entries.end(), [](const coo_entry<T>& x, const coo_entry<T>& y) {
+                return x.row < y.row || (x.row == y.row && x.col < y.col);
+            });
+
+            csr_matrix res;
+            res.rows = rows;
+            res.cols = cols;
+            res.row_ptr.assign(rows + 1, 0);
+            for (size_t i = 0; i < entries.size(); ++i) {
+                const auto& e = entries[i];
+                if (e.row < 0 || size_t(e.row) >= rows || e.col < 0 || size_t(e.col) >= cols)
+                    throw std::out_of_range("csr_matrix::from_coo: entry out of the matrix");
+                if (i > 0 && e.row == entries[i - 1].row && e.col == entries[i - 1].col) {
+                    res.values.back() += e.value;
+                    continue;
+                }
+                res.col.push_back(e.col);
+                res.values.push_back(e.value);
+                res.row_ptr[e.row + 1] += 1;
+            }
+            for (size_t r = 0; r < rows; ++r)
+                res.row_ptr[r + 1] += res.row_ptr[r];
+            return res;
+        }
+
+        matrix<T> to_dense() const {
+            matrix<T> res(rows, cols);
+            for (auto& x : res.items)
+                x = T(0);
+            for (size_t r = 0; r < rows; ++r)
+                for (cl_int i = row_ptr[r]; i < row_ptr[r + 1]; ++i)
+                    res(r, col[i]) = values[i];
+            return res;
+        }
+
+        // y = A x on the host
+        void multiply(const T* x, T* y) const {
+            for (size_t r = 0; r < rows; ++r) {
+                T sum = 0;
+                for (cl_int i = row_ptr[r]; i < row_ptr[r + 1]; ++i)
+                    sum += values[i] * x[col[i]];
+                y[r] = sum;
+            }
+        }
+
+        sparse_row_stats stats() const {
+            sparse_row_stats st;
+            st.rows = rows;
+            st.nnz = nnz();
+            if (rows == 0)
+                return st;
+            st.mean = double(st.nnz) / rows;
+            double sq = 0;
+            for (size_t r = 0; r < rows; ++r) {
+                const size_t len = row_ptr[r + 1] - row_ptr[r];
+                st.max = std::max(st.max, len);
+                st.empty += (len == 0);
+                sq += (len - st.mean) * (len - st.mean);
+            }
+            st.stddev = std::sqrt(sq / rows);
+            return st;
+        }
+    };
+
+
+    // SELL-C-sigma: rows are sorted by length within windows of sigma rows (perm maps a
+    // sorted row to the original one) and cut into slices of C rows. A slice is stored
+    // column by column and padded with zeros to its longest row, so C work-items handling
+    // its rows read consecutive addresses. ELL is the case C = rows, sigma = 1.
+    template<typename T>
+    struct sell_matrix {
+        size_t rows = 0;
+        size_t cols = 0;
+        size_t slice = 0;
+        std::vector<cl_int> slice_ptr = {0};    // first element of every slice, and the end
+        std::vector<cl_int> col;                // padding has column 0 and value 0
+        std::vector<T> values;
+        std::vector<cl_int> perm;
+
+        size_t padded() const { return values.size(); }
+
+        static sell_matrix from_csr(const csr_matrix<T>& a, size_t slice, size_t sigma = 1) {
+            if (slice == 0)
+                throw std::invalid_argument("sell_matrix::from_csr: slice height must be positive");
+
+            sell_matrix res;
+            res.rows = a.rows;
+            res.cols = a.cols;
+            res.slice = slice;
+            res.perm.resize(a.rows);
+            for (size_t r = 0; r < a.rows; ++r)
+                res.perm[r] = cl_int(r);
+
+            auto length = [&](cl_int r) { return a.row_ptr[r + 1] - a.row_ptr[r]; };
+            if (sigma > 1) {
+                for (size_t w = 0; w < a.rows; w += sigma) {
+                    auto end = res.perm.begin() + std::min(a.rows, w + sigma);
+                    std::stable_sort(res.perm.begin() + w, end, [&](cl_int x, cl_int y) { return length(x) > length(y); });
+                }
+            }
+
+            const size_t slices = (a.rows + slice - 1) / slice;
+            for (size_t s = 0; s < slices; ++s) {
+                cl_int width = 0;
+                for (size_t l = 0; l < slice && s * slice + l < a.rows; ++l)
+                    width = std::max(width, length(res.perm[s * slice + l]));
+                const size_t base = res.slice_ptr.back();
+                res.slice_ptr.push_back(cl_int(base + size_t(width) * slice));
+                res.col.resize(res.slice_ptr.back(), 0);
+                res.values.resize(res.slice_ptr.back(), T(0));
+
+                for (size_t l = 0; l < slice && s * slice + l < a.rows; ++l) {
+                    const cl_int r = res.perm[s * slice + l];
+                    for (cl_int j = 0; j < length(r); ++j) {
+                        res.col[base + j * slice + l] = a.col[a.row_ptr[r] + j];
+                        res.values[base + j * slice + l] = a.values[a.row_ptr[r] + j];
+                    }
+                }
+            }
+            return res;
+        }
+    };
+
+
+    // y = A x and Y = A X for sparse A. REAL is the element type, VEC the work-items per
+    // row of csr_spmv_vector, SLICE the slice height of the SELL matrix.
+    const char* sparse_kernel_code = R"(
+#ifdef USE_DOUBLE
+#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+#define REAL double
+#else
+#define REAL float
+#endif
+#ifndef VEC
+#define VEC 8
+#endif
+#ifndef SLICE
+#define SLICE 32
+#endif
+
+// a work-item per row
+__kernel void csr_spmv_scalar(int rows, __global const int* row_ptr, __global const int* col,
+                              __global const REAL* val, __global const REAL* x, __global REAL* y)
+{
+    const int r = get_global_id(0);
+    if (r >= rows)
+        return;
+    REAL sum = 0;
+    for (int i = row_ptr[r]; i < row_ptr[r + 1]; ++i)
+        sum += val[i] * x[col[i]];
+    y[r] = sum;
+}
+
+// VEC work-items per row (VEC divides the work-group size): lane l sums elements l, l + VEC, ...
+// of the row, so the lanes read the row together, then they add up in local memory
+__kernel void csr_spmv_vector(int rows, __global const int* row_ptr, __global const int* col,
+                              __global const REAL* val, __global const REAL* x, __global REAL* y,
+                              __local REAL* partial)
+{
+    const int lid = get_local_id(0);
+    const int lane = lid & (VEC - 1);
+    const int r = get_global_id(0) / VEC;
+
+    REAL sum = 0;
+    if (r < rows)
+        for (int i = row_ptr[r] + lane; i < row_ptr[r + 1]; i += VEC)
+            sum += val[i] * x[col[i]];
+    partial[lid] = sum;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (int s = VEC / 2; s > 0; s >>= 1) {
+        if (lane < s)
+            partial[lid] += partial[lid + s];
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+    if (lane == 0 && r < rows)
+        y[r] = partial[lid];
+}
+
+// a work-item per row of the SELL matrix, in sorted order
+__kernel void sell_spmv(int rows, __global const int* slice_ptr, __global const int* col,
+                        __global const REAL* val, __global const int* perm, __global const REAL* x, __global REAL* y)
+{
+    const int g = get_global_id(0);
+    if (g >= rows)
+        return;
+    const int base = slice_ptr[g / SLICE] + g % SLICE;
+    const int width = (slice_ptr[g / SLICE + 1] - slice_ptr[g / SLICE]) / SLICE;
+
+    REAL sum = 0;
+    for (int j = 0; j < width; ++j)
+        sum += val[base + j * SLICE] * x[col[base + j * SLICE]];
+    y[perm[g]] = sum;
+}
+
+// X is cols x n, Y is rows x n, row-major with leading dimensions ldx, ldy. Dimension 0 runs
+// along the n columns, so neighbouring work-items read neighbouring elements of X.
+__kernel void csr_spmm(int rows, int n, __global const int* row_ptr, __global const int* col, __global const REAL* val,
+                       __global const REAL* X, int ldx, __global REAL* Y, int ldy)
+{
+    const int j = get_global_id(0);
+    const int r = get_global_id(1);
+    if (r >= rows || j >= n)
+        return;
+    REAL sum = 0;
+    for (int i = row_ptr[r]; i < row_ptr[r + 1]; ++i)
+        sum += val[i] * X[(size_t)col[i] * ldx + j];
+    Y[(size_t)r * ldy + j] = sum;
+}
+
+__kernel void sell_spmm(int rows, int n, __global const int* slice_ptr, __global const int* col, __global const REAL* val,
+                        __global const int* perm, __global const REAL* X, int ldx, __global REAL* Y, int ldy)
+{
+    const int j = get_global_id(0);
+    const int g = get_global_id(1);
+    if (g >= rows || j >= n)
+        return;
+    const int base = slice_ptr[g / SLICE] + g % SLICE;
+    const int width = (slice_ptr[g / SLICE + 1] - slice_ptr[g / SLICE]) / SLICE;
+
+    REAL sum = 0;
+    for (int k = 0; k < width; ++k)
+        sum += val[base + k * SLICE] * X[(size_t)col[base + k * SLICE] * ldx + j];
+    Y[(size_t)perm[g] * ldy + j] = sum;
+}
+)";
+
+
+    enum class spmv_strategy { automatic, csr_scalar, csr_vector, sell };
+
+
+    const char* spmv_strategy_name(spmv_strategy s) {
+        switch (s) {
+        case spmv_strategy::csr_scalar: return "csr, row per work-item";
+        case spmv_strategy::csr_vector: return "csr, row per work-item group";
+        case spmv_strategy::sell: return "sell";
+        default: return "automatic";
+        }
+    }
+
+
+    // CPU runtimes run a work-item per row best: a core streams through its rows and
+    // vectorizes across work-items. On GPUs long rows are read by several work-items
+    // together, short rows of similar length go to SELL, which pads them little and makes
+    // the reads coalesced, and short irregular rows take a work-item each.
+    spmv_strategy choose_spmv(const sparse_row_stats& st, const device_description& dd) {
+        if (dd.type & CL_DEVICE_TYPE_CPU)
+            return spmv_strategy::csr_scalar;
+        if (st.mean >= 16)
+            return spmv_strategy::csr_vector;
+        if (st.variation() < 0.5)
+            return spmv_strategy::sell;
+        return spmv_strategy::csr_scalar;
+    }
+
+
+    // A sparse matrix on the device with its kernels, for one context. T is cl_float or
+    // cl_double. csr_vector uses the CSR arrays for SpMM, which has parallelism along the
+    // columns of X anyway.
+    template<typename T>
+    struct sparse_operator {
+        size_t rows;
+        size_t cols;
+        size_t nnz;
+        spmv_strategy strategy;
+        size_t vec = 1;         // work-items per row of csr_vector
+        size_t slice = 32;      // SELL slice height
+        size_t local;           // work-group size of the SpMV kernels
+        size_t device_bytes = 0;
+        std::unique_ptr<program> p;
+        mem_buffer row_ptr;
+        mem_buffer col;
+        mem_buffer val;
+        mem_buffer slice_ptr;
+        mem_buffer perm;
+
+        sparse_operator(context& ctx, const device_description& dd, const csr_matrix<T>& a, spmv_strategy s = spmv_strategy::automatic)
+            : rows(a.rows), cols(a.cols), nnz(a.nnz()) {
+            static_assert(precision<T>::bits >= 32, "sparse_operator: cl_float or cl_double elements");
+            if (precision<T>::bits == 64 && !dd.fp64()) {
+                clexception e(CL_INVALID_DEVICE);
+                e << "sparse_operator: " << dd.name << " has no double precision support";
+                throw e;
+            }
+
+            const auto st = a.stats();
+            strategy = (s == spmv_strategy::automatic) ? choose_spmv(st, dd) : s;
+            local = std::min<size_t>(128, dd.max_work_group);
+            if (strategy == spmv_strategy::csr_vector) {
+                vec = 2;
+                while (vec < 32 && vec * 2 <= st.mean && vec * 2 <= local)
+                    vec *= 2;
+                local -= local % vec;
+            }
+
+            if (strategy == spmv_strategy::sell) {
+                // sorting windows of a few slices keep x accesses local but cut the padding
+                const auto sell = sell_matrix<T>::from_csr(a, slice, 8 * slice);
+                slice_ptr = upload(ctx, sell.slice_ptr);
+                col = upload(ctx, sell.col);
+                val = upload(ctx, sell.values);
+                perm = upload(ctx, sell.perm);
+            }
+            // SpMM of the csr strategies, and the only format they need
+            row_ptr = upload(ctx, a.row_ptr);
+            if (strategy != spmv_strategy::sell) {
+                col = upload(ctx, a.col);
+                val = upload(ctx, a.values);
+            }
+
+            std::string options = "-DVEC=" + std::to_string(vec) + " -DSLICE=" + std::to_string(slice);
+            if (precision<T>::bits == 64)
+                options += " -DUSE_DOUBLE";
+            p = std::make_unique<program>(ctx.create_program(sparse_kernel_code, options.c_str()));
+        }
+
+        template<typename U>
+        mem_buffer upload(context& ctx, const std::vector<U>& v) {
+            // a buffer cannot be empty, the kernels do not read it then
+            const size_t sz = std::max<size_t>(v.size(), 1) * sizeof(U);
+            device_bytes += sz;
+            if (v.empty())
+                return mem_buffer(ctx.create_buffer(CL_MEM_READ_ONLY, sz));
+            return mem_buffer(ctx.create_buffer(CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sz, const_cast<U*>(v.data())));
+        }
+
+        static size_t round_up(size_t x, size_t m) {
+            return (x + m - 1) / m * m;
+        }
+
+        // y = A x; x has cols elements, y rows
+        void spmv(command_queue& q, cl_mem x, cl_mem y) {
+            if (rows == 0)
+                return;
+            const cl_int r = cl_int(rows);
+            if (strategy == spmv_strategy::sell) {
+                p->get_kernel("sell_spmv")(q, nd_range(round_up(rows, local)).with_local(local), r, slice_ptr, col, val, perm, x, y);
+            }
+            else if (strategy == spmv_strategy::csr_vector) {
+                p->get_kernel("csr_spmv_vector")(q, nd_range(round_up(rows * vec, local)).with_local(local), r, row_ptr, col, val, x, y,
+                    local_memory{local * sizeof(T)});
+            }
+            else {
+                p->get_kernel("csr_spmv_scalar")(q, nd_range(round_up(rows, local)).with_local(local), r, row_ptr, col, val, x, y);
+            }
+        }
+
+        // Y = A X; X is cols x n with leading dimension ldx, Y is rows x n with ldy
+        void spmm(command_queue& q, size_t n, cl_mem x, size_t ldx, cl_mem y, size_t ldy) {
+            if (rows == 0 || n == 0)
+                return;
+            const cl_int r = cl_int(rows);
+            if (strategy == spmv_strategy::sell) {
+                p->get_kernel("sell_spmm")(q, nd_range(n, rows), r, cl_int(n), slice_ptr, col, val, perm, x, cl_int(ldx), y, cl_int(ldy));
+            }
+            else {
+                p->get_kernel("csr_spmm")(q, nd_range(n, rows), r, cl_int(n), row_ptr, col, val, x, cl_int(ldx), y, cl_int(ldy));
+            }
+        }
+    };
+}
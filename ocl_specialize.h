@@ -0,0 +1,104 @@
+#pragma once
+#include <algorithm>
+#include <list>
+#include <memory>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <CL/cl.h>
+
+#include "ocl_error.h"
+#include "ocl_helpers.h"
+
+namespace ocl {
+
+    struct specialization_stats {
+        size_t hits = 0;        // specialized variant found in the cache
+        size_t builds = 0;      // specialized variant built (or loaded from the program cache)
+        size_t generic = 0;     // shape not seen often enough yet, the caller's generic kernel is used
+        size_t evictions = 0;
+    };
+
+
+    std::ostream& operator<<(std::ostream& str, const specialization_stats& st) {
+        str << st.hits << " hits, " << st.builds << " builds, " << st.generic << " generic, "
+            << st.evictions << " evictions";
+        return str;
+    }
+
+
+    // Kernel variants compiled with problem constants baked in as -D options, for one context.
+    //
+    // A kernel supporting specialization reads e.g. SPEC_M instead of its runtime argument
+    // when the macro is defined, so the compiler can fold index arithmetic, drop edge guards
+    // and unroll loops with known trip counts. Variants are kept in an LRU of `capacity`
+    // entries keyed by (device, kernel, options + specialization). A specialization is only
+    // built once it has been asked for `min_uses` times: until then get() returns NULL and
+    // the caller launches its generic kernel, so shapes seen once never pay for a build.
+    struct specialization_cache {
+        struct entry {
+            std::string key;
+            std::unique_ptr<program> p;
+            kernel* k;
+        };
+
+        context& ctx;
+        size_t capacity;
+        size_t min_uses;
+        std::list<entry> lru;   // most recently used first
+        std::unordered_map<std::string, std::list<entry>::iterator> index;
+        std::unordered_map<std::string, size_t> seen;   // uses of specializations not built yet
+        specialization_stats stats;
+
+        specialization_cache(context& ctx, size_t capacity = 16, size_t min_uses = 2)
+            : ctx(ctx), capacity(std::max<size_t>(capacity, 1)), min_uses(min_uses) {}
+
+        specialization_cache(const specialization_cache&) = delete;
+        specialization_cache& operator=(const specialization_cache&) = delete;
+
+        // " -DNAME=value", to build spec strings
+        static std::string define(const char* name, long long value) {
+            return std::string(" -D") + name + "=" + std::to_string(value);
+        }
+
+        // Kernel kernel_name of code built with options + spec, or NULL if the caller should
+        // use its generic variant (built with options only). The kernel stays valid until
+        // the next get() call.
+        kernel* get(const char* code, const char* kernel_name, const std::string& options, const std::string& spec) {
+            std::stringstream k;
+            k << ctx.did << '\n' << kernel_name << '\n' << options << spec;
+            const std::string key = k.str();
+
+            auto it = index.find(key);
+            if (it != index.end()) {
+                lru.splice(lru.begin(), lru, it->second);
+                stats.hits += 1;
+                return lru.front().k;
+            }
+
+            // bounded: a stream of distinct shapes must not grow the counters forever
+            if (seen.size() > capacity * 64)
+                seen.clear();
+            if (++seen[key] < min_uses) {
+                stats.generic += 1;
+                return NULL;
+            }
+            seen.erase(key);
+
+            const std::string all = options + spec;
+            auto p = std::make_unique<program>(ctx.create_program(code, all.c_str()));
+            kernel* kr = &p->get_kernel(kernel_name);
+            lru.push_front({key, std::move(p), kr});
+            index[key] = lru.begin();
+            stats.builds += 1;
+
+            while (lru.size() > capacity) {
+                index.erase(lru.back().key);
+                lru.pop_back();
+                stats.evictions += 1;
+            }
+            return kr;
+        }
+    };
+}
@@ -0,0 +1,114 @@
+#pragma once
+#include <algorithm>
+#include <climits>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+#include <CL/cl.h>
+
+#include "ocl_error.h"
+#include "ocl_device.h"
+#include "ocl_helpers.h"
+
+namespace ocl {
+
+    // Runs a 1-D element-wise kernel over data which need not fit the device, chunk by chunk,
+    // overlapping the upload of chunk i+1, the kernel on chunk i and the download of chunk i-1.
+    //
+    // Three in-order queues (upload, compute, download) are linked by events, and `depth`
+    // sets of buffers rotate between them: chunk i may be uploaded once the kernel of chunk
+    // i-depth has consumed its input buffer, and its kernel may start once the download of
+    // chunk i-depth has emptied its output buffer.
+    //
+    // Kernel contract: argument 0 is __global const In*, 1 is __global Out*, 2 is int count,
+    // the kernel handles work-item get_global_id(0) < count. Other arguments are set by the
+    // caller before run(). The chunk size is at most INT_MAX elements, it is bounded by
+    // CL_DEVICE_MAX_MEM_ALLOC_SIZE, and all buffers together take at most half of the
+    // device global memory.
+    template<typename In, typename Out>
+    struct stream_pipeline {
+        context& ctx;
+        command_queue upload;
+        command_queue compute;
+        command_queue download;
+        size_t chunk;   // elements per chunk
+        size_t depth;   // buffer sets, 2 or 3
+        std::vector<std::unique_ptr<mem_buffer>> in;
+        std::vector<std::unique_ptr<mem_buffer>> out;
+
+        stream_pipeline(context& ctx, size_t chunk_items = 1 << 24, size_t depth = 3, cl_command_queue_properties properties = 0)
+            : ctx(ctx), upload(ctx.create_queue(properties)), compute(ctx.create_queue(properties)),
+              download(ctx.create_queue(properties)), depth(depth)
+        {
+            if (depth < 2)
+                throw std::invalid_argument("stream_pipeline: depth must be at least 2");
+            // the kernel takes the count as int
+            if (chunk_items > size_t(INT_MAX))
+                throw std::invalid_argument("stream_pipeline: chunk_items is more than INT_MAX");
+
+            const size_t item = std::max(sizeof(In), sizeof(Out));
+            const size_t max_alloc = get_device_data<cl_ulong>(ctx.did, CL_DEVICE_MAX_MEM_ALLOC_SIZE);
+            const size_t global = get_device_data<cl_ulong>(ctx.did, CL_DEVICE_GLOBAL_MEM_SIZE);
+            chunk = std::min(chunk_items, max_alloc / item);
+            chunk = std::min(chunk, global / 2 / depth / (sizeof(In) + sizeof(Out)));
+            if (chunk == 0)
+                throw std::invalid_argument("stream_pipeline: chunk size is 0");
+
+            for (size_t i = 0; i < depth; ++i) {
+                in.push_back(std::make_unique<mem_buffer>(ctx.create_buffer(CL_MEM_READ_ONLY, chunk * sizeof(In))));
+                out.push_back(std::make_unique<mem_buffer>(ctx.create_buffer(CL_MEM_WRITE_ONLY, chunk * sizeof(Out))));
+            }
+        }
+
+        // dst[0, n) = kernel(src[0, n)); src and dst must stay valid until run() returns.
+        // ws is the work-group size, 0 lets the driver (or the compute queue's tuning table) choose.
+        void run(cl_kernel kernel, const In* src, Out* dst, size_t n, size_t ws = 0) {
+            std::vector<event> computed(depth);
+            std::vector<event> read(depth);
+
+            for (size_t i = 0, offset = 0; offset < n; ++i, offset += chunk) {
+                const size_t s = i % depth;
+                const size_t count = std::min(chunk, n - offset);
+
+                // input buffer is free once the kernel of the previous chunk in this slot is done
+                std::vector<cl_event> wait;
+                if (computed[s].e != NULL)
+                    wait.push_back(computed[s].e);
+                event w;
+                upload.write_buffer(in[s]->m, 0, src + offset, count * sizeof(In), false, &w.e, wait);
+
+                // output buffer is free once the previous chunk in this slot is downloaded
+                wait = {w.e};
+                if (read[s].e != NULL)
+                    wait.push_back(read[s].e);
+                const int icount = static_cast<int>(count);
+                kernel_arg(kernel, 0, sizeof(cl_mem), &in[s]->m);
+                kernel_arg(kernel, 1, sizeof(cl_mem), &out[s]->m);
+                kernel_arg(kernel, 2, sizeof(int), &icount);
+                const size_t range = ws ? (count + ws - 1) / ws * ws : count;
+                event k;
+                compute.run1d(kernel, range, ws, &k.e, wait);
+
+                event r;
+                download.read_buffer(out[s]->m, 0, dst + offset, count * sizeof(Out), false, &r.e, {k.e});
+
+                computed[s] = std::move(k);
+                read[s] = std::move(r);
+
+                clFlush(upload.q);
+                clFlush(compute.q);
+                clFlush(download.q);
+            }
+
+            upload.finish();
+            compute.finish();
+            download.finish();
+        }
+
+        static void kernel_arg(cl_kernel kernel, cl_uint n, size_t sz, const void* p) {
+            cl_int ret = clSetKernelArg(kernel, n, sz, p);
+            if (ret != CL_SUCCESS)
+                throw clexception("clSetKernelArg", ret);
+        }
+    };
+}
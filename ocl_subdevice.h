@@ -0,0 +1,134 @@
+#pragma once
+#include <algorithm>
+#include <vector>
+#include <CL/cl.h>
+
+#include "ocl_error.h"
+#include "ocl_device.h"
+
+namespace ocl {
+
+    // Sub-devices of one device, made with clCreateSubDevices and released on destruction.
+    //
+    // Every sub-device gets its own context and queue from the user of the set (e.g.
+    // multi_device_gemm over `devices`), so the worker threads of a CPU runtime stay on
+    // their cores and the buffers they touch first are allocated on their NUMA node.
+    struct sub_device_set {
+        std::vector<cl_device_id> ids;
+        std::vector<device_description> devices;
+
+        sub_device_set() {}
+        sub_device_set(const sub_device_set&) = delete;
+        sub_device_set(sub_device_set&& x) : ids(std::move(x.ids)), devices(std::move(x.devices)) {
+            x.ids.clear();
+        }
+        ~sub_device_set() {
+            release();
+        }
+
+        sub_device_set& operator=(const sub_device_set&) = delete;
+        sub_device_set& operator=(sub_device_set&& x) {
+            std::swap(ids, x.ids);
+            std::swap(devices, x.devices);
+            return *this;
+        }
+
+        void release() {
+            for (auto id : ids)
+                clReleaseDevice(id);
+            ids.clear();
+            devices.clear();
+        }
+
+        size_t size() const {
+            return ids.size();
+        }
+
+        // CL_DEVICE_PARTITION_EQUALLY, CL_DEVICE_PARTITION_BY_COUNTS or CL_DEVICE_PARTITION_BY_AFFINITY_DOMAIN
+        static bool supports(cl_device_id did, cl_device_partition_property type) {
+            size_t sz = 0;
+            cl_int ret = clGetDeviceInfo(did, CL_DEVICE_PARTITION_PROPERTIES, 0, NULL, &sz);
+            if (ret != CL_SUCCESS)
+                throw clexception("clGetDeviceInfo", ret);
+
+            std::vector<cl_device_partition_property> props(sz / sizeof(cl_device_partition_property));
+            ret = clGetDeviceInfo(did, CL_DEVICE_PARTITION_PROPERTIES, sz, props.data(), NULL);
+            if (ret != CL_SUCCESS)
+                throw clexception("clGetDeviceInfo", ret);
+            return std::find(props.begin(), props.end(), type) != props.end();
+        }
+
+        // props is a 0-terminated property list for clCreateSubDevices
+        static sub_device_set create(cl_device_id did, const std::vector<cl_device_partition_property>& props) {
+            cl_uint count = 0;
+            cl_int ret = clCreateSubDevices(did, props.data(), 0, NULL, &count);
+            if (ret != CL_SUCCESS)
+                throw clexception("clCreateSubDevices", ret);
+
+            sub_device_set res;
+            res.ids.resize(count);
+            ret = clCreateSubDevices(did, props.data(), count, res.ids.data(), NULL);
+            if (ret != CL_SUCCESS) {
+                res.ids.clear();
+                throw clexception("clCreateSubDevices", ret);
+            }
+            for (auto id : res.ids)
+                res.devices.push_back(describe_device(id));
+            return res;
+        }
+
+        // as many sub-devices of `units` compute units each as fit
+        static sub_device_set equally(cl_device_id did, cl_uint units) {
+            return create(did, {CL_DEVICE_PARTITION_EQUALLY, cl_device_partition_property(units), 0});
+        }
+
+        // one sub-device per entry of counts, with that many compute units
+        static sub_device_set by_counts(cl_device_id did, const std::vector<cl_uint>& counts) {
+            std::vector<cl_device_partition_property> props = {CL_DEVICE_PARTITION_BY_COUNTS};
+            for (auto c : counts)
+                props.push_back(c);
+            props.push_back(CL_DEVICE_PARTITION_BY_COUNTS_LIST_END);
+            props.push_back(0);
+            return create(did, props);
+        }
+
+        // One sub-device per NUMA node (or whatever domain is asked for). A domain the device
+        // does not support falls back to the next finer one it does: NUMA, L4, L3, L2, L1 cache.
+        // If none works, or partitioning leaves a single sub-device, the set holds the device
+        // itself, so the caller always gets at least one device to run on.
+        static sub_device_set by_affinity(cl_device_id did, cl_device_affinity_domain domain = CL_DEVICE_AFFINITY_DOMAIN_NUMA) {
+            const cl_device_affinity_domain order[] = {
+                CL_DEVICE_AFFINITY_DOMAIN_NUMA, CL_DEVICE_AFFINITY_DOMAIN_L4_CACHE, CL_DEVICE_AFFINITY_DOMAIN_L3_CACHE,
+                CL_DEVICE_AFFINITY_DOMAIN_L2_CACHE, CL_DEVICE_AFFINITY_DOMAIN_L1_CACHE,
+            };
+
+            if (supports(did, CL_DEVICE_PARTITION_BY_AFFINITY_DOMAIN)) {
+                const auto supported = get_device_data<cl_device_affinity_domain>(did, CL_DEVICE_PARTITION_AFFINITY_DOMAIN);
+                std::vector<cl_device_affinity_domain> tries = {domain};
+                auto finer = std::find(std::begin(order), std::end(order), domain);
+                tries.insert(tries.end(), (finer == std::end(order)) ? std::begin(order) : finer + 1, std::end(order));
+
+                for (auto d : tries) {
+                    if (!(supported & d))
+                        continue;
+                    try {
+                        auto res = create(did, {CL_DEVICE_PARTITION_BY_AFFINITY_DOMAIN, cl_device_partition_property(d), 0});
+                        if (res.size() > 1)
+                            return res;
+                    }
+                    catch (clexception& e) {
+                        if (e.ret != CL_DEVICE_PARTITION_FAILED && e.ret != CL_INVALID_VALUE)
+                            throw;
+                    }
+                }
+            }
+
+            // retained to balance release(); both are no-ops for a root device
+            clRetainDevice(did);
+            sub_device_set res;
+            res.ids.push_back(did);
+            res.devices.push_back(describe_device(did));
+            return res;
+        }
+    };
+}
@@ -0,0 +1,274 @@
+#pragma once
+// Timeline of the wrapper calls, compiled in with -DOCL_TRACE and empty otherwise.
+//
+// Every wrapper call taking time (building programs, creating buffers and queues,
+// enqueues, waits) records a host span; on queues with CL_QUEUE_PROFILING_ENABLE every
+// command also records its device execution, moved onto the host clock. Spans go to a
+// ring buffer per thread (the oldest are overwritten), and trace_dump() writes them as
+// Chrome trace-event JSON, which chrome://tracing and ui.perfetto.dev open. A thread's
+// buffer takes OCL_TRACE_CAPACITY * sizeof(trace_record) bytes and is kept after the
+// thread exits, until the process ends. With $OCL_TRACE_FILE set the trace is also
+// written there when the program exits.
+//
+//     OCL_TRACE_SPAN("clBuildProgram");                   // the enclosing block
+//     OCL_TRACE_SPAN("clEnqueueWriteBuffer", bytes);
+//     OCL_TRACE_SPAN("clEnqueueNDRangeKernel", 0, name);  // name: a detail shown with the span
+//
+// Without OCL_TRACE the macro and its arguments vanish.
+
+#ifndef OCL_TRACE
+
+#define OCL_TRACE_SPAN(...) ((void)0)
+
+#else
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+#include <CL/cl.h>
+
+#ifndef OCL_TRACE_CAPACITY
+#define OCL_TRACE_CAPACITY (1 << 15)    // spans per thread, a power of two
+#endif
+
+#define OCL_TRACE_CAT_(a, b) a##b
+#define OCL_TRACE_CAT(a, b) OCL_TRACE_CAT_(a, b)
+#define OCL_TRACE_SPAN(...) ::ocl::trace_span OCL_TRACE_CAT(ocl_trace_span_, __LINE__)(__VA_ARGS__)
+
+namespace ocl {
+
+    struct trace_record {
+        const char* name;       // a string literal
+        char detail[40];        // kernel name and the like, cut to fit
+        uint64_t start;         // ns on the host clock, see trace_now()
+        uint64_t end;
+        uint64_t bytes;
+        uint64_t queue;         // the cl_command_queue of a device span, 0 for a host span
+    };
+
+
+    // Written only by its thread, so a push is a store and a release increment. Kept by
+    // the registry after the thread exits, for the dump.
+    struct trace_buffer {
+        uint32_t tid;
+        std::vector<trace_record> ring;
+        std::atomic<uint64_t> head{0};
+
+        explicit trace_buffer(uint32_t tid) : tid(tid), ring(OCL_TRACE_CAPACITY) {}
+
+        void push(const trace_record& r) {
+            const uint64_t h = head.load(std::memory_order_relaxed);
+            ring[h & (OCL_TRACE_CAPACITY - 1)] = r;
+            head.store(h + 1, std::memory_order_release);
+        }
+    };
+
+
+    struct trace_registry {
+        std::mutex mtx;
+        std::vector<std::shared_ptr<trace_buffer>> buffers;
+
+        ~trace_registry();
+
+        static trace_registry& get() {
+            static trace_registry r;
+            return r;
+        }
+
+        trace_buffer& local() {
+            static thread_local std::shared_ptr<trace_buffer> mine;
+            if (!mine) {
+                std::lock_guard<std::mutex> lk(mtx);
+                mine = std::make_shared<trace_buffer>(uint32_t(buffers.size() + 1));
+                buffers.push_back(mine);
+            }
+            return *mine;
+        }
+    };
+
+
+    // ns since the first call
+    uint64_t trace_now() {
+        static const auto epoch = std::chrono::steady_clock::now();
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch).count();
+    }
+
+
+    void trace_set_detail(trace_record& r, const char* detail) {
+        r.detail[0] = 0;
+        if (detail != NULL) {
+            std::strncpy(r.detail, detail, sizeof(r.detail) - 1);
+            r.detail[sizeof(r.detail) - 1] = 0;
+        }
+    }
+
+
+    struct trace_span {
+        trace_record r;
+
+        explicit trace_span(const char* name, size_t bytes = 0, const char* detail = NULL) {
+            r.name = name;
+            r.bytes = bytes;
+            r.queue = 0;
+            trace_set_detail(r, detail);
+            r.start = trace_now();
+        }
+
+        trace_span(const char* name, size_t bytes, const std::string& detail) : trace_span(name, bytes, detail.c_str()) {}
+
+        trace_span(const trace_span&) = delete;
+        trace_span& operator=(const trace_span&) = delete;
+
+        ~trace_span() {
+            r.end = trace_now();
+            trace_registry::get().local().push(r);
+        }
+    };
+
+
+    // function name of a kernel for span details, one query into a fixed buffer
+    std::string trace_kernel_name(cl_kernel k) {
+        char name[64];
+        if (clGetKernelInfo(k, CL_KERNEL_FUNCTION_NAME, sizeof(name), name, NULL) != CL_SUCCESS)
+            return "kernel";
+        return name;
+    }
+
+
+    struct trace_pending {
+        trace_record r;
+        uint64_t enqueued;      // host time of the enqueue
+    };
+
+
+    // Device timestamps are read when the command completes, on the runtime's callback
+    // thread. CL_PROFILING_COMMAND_QUEUED is taken as the host time of the enqueue, which
+    // moves the device span onto the host clock within the cost of the enqueue call.
+    void CL_CALLBACK trace_device_callback(cl_event e, cl_int status, void* p) {
+        std::unique_ptr<trace_pending> t(static_cast<trace_pending*>(p));
+        cl_ulong queued = 0, start = 0, end = 0;
+        if (status == CL_COMPLETE
+            && clGetEventProfilingInfo(e, CL_PROFILING_COMMAND_QUEUED, sizeof(queued), &queued, NULL) == CL_SUCCESS
+            && clGetEventProfilingInfo(e, CL_PROFILING_COMMAND_START, sizeof(start), &start, NULL) == CL_SUCCESS
+            && clGetEventProfilingInfo(e, CL_PROFILING_COMMAND_END, sizeof(end), &end, NULL) == CL_SUCCESS
+            && start >= queued && end >= start) {
+            t->r.start = t->enqueued + (start - queued);
+            t->r.end = t->enqueued + (end - queued);
+            trace_registry::get().local().push(t->r);
+        }
+        clReleaseEvent(e);
+    }
+
+
+    // called by command_queue for every command with an event on a profiling queue; a
+    // failure only loses the span
+    void trace_device_command(cl_command_queue q, cl_event e, cl_command_type type, const std::string& name, size_t bytes) {
+        auto t = std::make_unique<trace_pending>();
+        t->enqueued = trace_now();
+        t->r.name = (type == CL_COMMAND_NDRANGE_KERNEL) ? "kernel"
+                  : (type == CL_COMMAND_READ_BUFFER || type == CL_COMMAND_READ_BUFFER_RECT) ? "read"
+                  : (type == CL_COMMAND_WRITE_BUFFER || type == CL_COMMAND_WRITE_BUFFER_RECT) ? "write" : "command";
+        trace_set_detail(t->r, name.c_str());
+        t->r.bytes = bytes;
+        t->r.queue = reinterpret_cast<uintptr_t>(q);
+        clRetainEvent(e);
+        if (clSetEventCallback(e, CL_COMPLETE, trace_device_callback, t.get()) == CL_SUCCESS)
+            t.release();
+        else
+            clReleaseEvent(e);
+    }
+
+
+    std::string trace_json_string(const char* s) {
+        std::string res = "\"";
+        for (; *s; ++s) {
+            if (*s == '"' || *s == '\\')
+                res += '\\';
+            if (static_cast<unsigned char>(*s) >= 0x20)
+                res += *s;
+        }
+        return res + "\"";
+    }
+
+
+    // Chrome trace-event JSON of all spans recorded so far: host threads are the tracks of
+    // process 1, device queues those of process 2. Spans a thread records while the dump
+    // runs may come out torn or missing.
+    void trace_dump(std::ostream& str) {
+        auto& reg = trace_registry::get();
+        std::vector<std::shared_ptr<trace_buffer>> buffers;
+        {
+            std::lock_guard<std::mutex> lk(reg.mtx);
+            buffers = reg.buffers;
+        }
+
+        std::map<uint64_t, size_t> queues;      // device track per queue
+        char num[64];
+        auto us = [&](uint64_t ns) {
+            std::snprintf(num, sizeof(num), "%.3f", ns / 1e3);
+            return std::string(num);
+        };
+
+        str << "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n";
+        str << "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"args\": {\"name\": \"host\"}},\n";
+        str << "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 2, \"args\": {\"name\": \"device\"}}";
+        for (const auto& b : buffers) {
+            const uint64_t head = b->head.load(std::memory_order_acquire);
+            if (head == 0)
+                continue;
+            str << ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << b->tid
+                << ", \"args\": {\"name\": \"thread " << b->tid << "\"}}";
+
+            const uint64_t first = head > OCL_TRACE_CAPACITY ? head - OCL_TRACE_CAPACITY : 0;
+            for (uint64_t i = first; i < head; ++i) {
+                const trace_record r = b->ring[i & (OCL_TRACE_CAPACITY - 1)];
+                const bool device = r.queue != 0;
+                size_t tid = b->tid;
+                if (device) {
+                    auto it = queues.find(r.queue);
+                    if (it == queues.end()) {
+                        it = queues.emplace(r.queue, queues.size() + 1).first;
+                        str << ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 2, \"tid\": " << it->second
+                            << ", \"args\": {\"name\": \"queue " << it->second << "\"}}";
+                    }
+                    tid = it->second;
+                }
+                str << ",\n{\"name\": " << trace_json_string(r.detail[0] && device ? r.detail : r.name)
+                    << ", \"cat\": \"" << (device ? "device" : "host") << "\", \"ph\": \"X\", \"pid\": " << (device ? 2 : 1)
+                    << ", \"tid\": " << tid << ", \"ts\": " << us(r.start) << ", \"dur\": " << us(r.end - r.start)
+                    << ", \"args\": {\"call\": " << trace_json_string(r.name);
+                if (r.detail[0] && std::strcmp(r.detail, r.name) != 0)
+                    str << ", \"detail\": " << trace_json_string(r.detail);
+                if (r.bytes)
+                    str << ", \"bytes\": " << r.bytes;
+                str << "}}";
+            }
+        }
+        str << "\n]}\n";
+    }
+
+
+    bool trace_dump(const std::string& path) {
+        std::ofstream f(path);
+        trace_dump(f);
+        return bool(f);
+    }
+
+
+    trace_registry::~trace_registry() {
+        if (const char* path = std::getenv("OCL_TRACE_FILE"))
+            trace_dump(path);
+    }
+}
+
+#endif
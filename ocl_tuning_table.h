@@ -0,0 +1,113 @@
+#pragma once
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+#include "ocl_program_cache.h"
+
+namespace ocl {
+
+    // Winner of an autotuning run, see ocl_autotune.h
+    struct tuned_config {
+        std::string options;        // build options of the kernel variant
+        size_t local[2] = {0, 0};   // work-group size, 0 for unused dimensions
+        double ms = 0;              // time of one launch during tuning
+    };
+
+
+    // Persisted autotuning results, keyed by (device name, kernel name, problem shape bucket).
+    // A bucket rounds every dimension of the shape up to a power of two, so close shapes share
+    // one entry. The file is plain text, one entry per line:
+    //   device <tab> kernel <tab> bucket <tab> local0 <tab> local1 <tab> ms <tab> options
+    struct tuning_table {
+        std::string path;
+        std::map<std::string, tuned_config> entries;
+
+        tuning_table(const std::string& path = default_path()) : path(path) {
+            load();
+        }
+
+        // $OCL_TUNING_FILE or tuning.txt in the program cache directory
+        static std::string default_path() {
+            if (const char* p = std::getenv("OCL_TUNING_FILE"))
+                return p;
+            return program_cache::default_dir() + "/tuning.txt";
+        }
+
+        static std::string bucket(const std::vector<size_t>& shape) {
+            std::stringstream s;
+            for (size_t i = 0; i < shape.size(); ++i) {
+                size_t b = 1;
+                while (b < shape[i])
+                    b *= 2;
+                s << (i ? "x" : "") << b;
+            }
+            return s.str();
+        }
+
+        static std::string key(const std::string& device, const std::string& kernel, const std::vector<size_t>& shape) {
+            return device + "\t" + kernel + "\t" + bucket(shape);
+        }
+
+        const tuned_config* find(const std::string& device, const std::string& kernel, const std::vector<size_t>& shape) const {
+            auto it = entries.find(key(device, kernel, shape));
+            return (it != entries.end()) ? &it->second : NULL;
+        }
+
+        void store(const std::string& device, const std::string& kernel, const std::vector<size_t>& shape, const tuned_config& c) {
+            entries[key(device, kernel, shape)] = c;
+        }
+
+        // a missing or unreadable file is an empty table
+        void load() {
+            std::ifstream f(path);
+            std::string line;
+            while (std::getline(f, line)) {
+                std::vector<std::string> fields;
+                std::stringstream s(line);
+                std::string field;
+                while (std::getline(s, field, '\t'))
+                    fields.push_back(field);
+                if (fields.size() < 6)
+                    continue;
+
+                tuned_config c;
+                c.local[0] = std::strtoull(fields[3].c_str(), NULL, 10);
+                c.local[1] = std::strtoull(fields[4].c_str(), NULL, 10);
+                c.ms = std::strtod(fields[5].c_str(), NULL);
+                c.options = (fields.size() > 6) ? fields[6] : "";
+                entries[fields[0] + "\t" + fields[1] + "\t" + fields[2]] = c;
+            }
+        }
+
+        // written to a temporary file and renamed; errors are ignored, the results are only lost
+        void save() const {
+            std::error_code ec;
+            auto dir = std::filesystem::path(path).parent_path();
+            if (!dir.empty())
+                std::filesystem::create_directories(dir, ec);
+
+            const auto tmp = path + "." + std::to_string(getpid()) + ".tmp";
+            {
+                std::ofstream f(tmp, std::ios::trunc);
+                for (const auto& e : entries)
+                    f << e.first << "\t" << e.second.local[0] << "\t" << e.second.local[1] << "\t"
+                      << e.second.ms << "\t" << e.second.options << "\n";
+                if (!f) {
+                    f.close();
+                    std::remove(tmp.c_str());
+                    return;
+                }
+            }
+            std::filesystem::rename(tmp, path, ec);
+            if (ec)
+                std::remove(tmp.c_str());
+        }
+    };
+}
@@ -4,30 +4,30 @@
 #include <string>
 #include <cmath>
 #include <tuple>
+#include <algorithm>
+#include <exception>
+#include <thread>
 #include <CL/cl.h> 
 #include "ocl_helpers.h"       
 #include "ocl_device.h"
+#include "ocl_gemm.h"
+#include "ocl_profiling.h"
+#include "ocl_multi_device.h"
+#include "ocl_cpu_gemm.h"
+#include "ocl_subdevice.h"
+#include "ocl_precision.h"
+#include "ocl_graph.h"
+#include "ocl_matrix_file.h"
+#include "ocl_session.h"
+#include "ocl_sparse.h"
+#include "ocl_primitives.h"
+#include "ocl_runtime.h"
 
 using namespace std;
 using namespace ocl;
 
-const char* kernel_two_dims_t = R"(
-__kernel void mx_mul(int rows, int cols, int to_sum, __global const float *A, __global const float *B, __global float *C)
-{
-    int i = get_global_id(0);
-    int j = get_global_id(1);
-
-    float x = 0;
-
-    for (int k = 0; k < to_sum; ++k)
-        x += A[i * to_sum + k] * B[j * to_sum + k];
-
-    C[i * cols + j] = x;
-}
-)";
-
 using cl_item = cl_float;
-using Matrix = vector<vector<float>>;
+using Matrix = ocl::matrix<cl_item>;
 
 
 struct timer {
@@ -55,19 +55,18 @@ struct timer {
 
 
 Matrix transpose_multiplication(const Matrix& m1, const Matrix& m2) {
-    Matrix res(m1.size());
+    using item_type = Matrix::value_type;
 
-    using item_type = Matrix::value_type::value_type;
+    const auto rows = m1.rows;
+    const auto cols = m2.rows;
+    const auto to_sum = m1.cols;
 
-    const auto rows = m1.size();
-    const auto cols = m2.size();
-    const auto to_sum = m1[0].size();
+    Matrix res(rows, cols);
 
     for (size_t i = 0; i < rows; ++i) {
-        res[i].resize(cols);
-        auto& r = m1[i];
+        auto r = m1[i];
         for (size_t j = 0; j < cols; ++j) {
-            auto& c = m2[j];
+            auto c = m2[j];
             item_type x = 0;
             for (size_t k = 0; k < to_sum; ++k)
                 x += r[k] * c[k];
@@ -79,67 +78,74 @@ Matrix transpose_multiplication(const Matrix& m1, const Matrix& m2) {
 }
 
 
-auto ocl_simple_multiplication(cl_device_id did, const Matrix& m1, const Matrix& m2t, const char* kernel_code, int ws) {
-    Matrix res(m1.size());
-    timer t;
-
-    int rows = m1.size();
-    int cols = m2t.size();
-    int to_sum = m1[0].size();
+// the product in Storage precision, on the session's context, kernels and buffers;
+// the queue of s must have profiling enabled
+template<typename Storage>
+auto ocl_simple_multiplication(session& s, const Matrix& m1, const Matrix& m2t) {
+    using StorageMatrix = ocl::matrix<Storage>;
+    queue_profile prof;
 
-    if (rows % 8 != 0 || cols % 8 != 0) {
-        throw runtime_error("this simple code can't multiply matrixes which sizes are not divisible by 8");
-    }
+    int rows = m1.rows;
+    int cols = m2t.rows;
+    int to_sum = m1.cols;
 
-    for (size_t i = 0; i < rows; ++i) {
-        res[i].resize(cols);
-    }
- 
-    context ctx(did);
-
-    mem_buffer a_mem_obj = ctx.create_buffer(CL_MEM_READ_ONLY, m1.size() * m1[0].size() * sizeof(cl_item));
-    mem_buffer b_mem_obj = ctx.create_buffer(CL_MEM_READ_ONLY, m2t.size() * m2t[0].size() * sizeof(cl_item));
-    mem_buffer c_mem_obj = ctx.create_buffer(CL_MEM_WRITE_ONLY, res.size() * res[0].size() * sizeof(cl_item));
-
-    command_queue queue = ctx.create_queue();
+    const StorageMatrix a = convert<Storage>(m1);
+    const StorageMatrix bt = convert<Storage>(m2t);
+    StorageMatrix c(rows, cols);
+    gemm_config used;
 
     try {
-        program p = ctx.create_program(kernel_code);
-        kernel k = p.create_kernel("mx_mul");
-
-        k.setArg(0, sizeof(int), &rows);
-        k.setArg(1, sizeof(int), &cols);
-        k.setArg(2, sizeof(int), &to_sum);
-        k.setArg(3, sizeof(cl_mem), &a_mem_obj.m);
-        k.setArg(4, sizeof(cl_mem), &b_mem_obj.m);
-        k.setArg(5, sizeof(cl_mem), &c_mem_obj.m);
-
-        size_t offset = 0;
-        for (const auto& v : m1) 
-            offset += queue.write_buffer_async(a_mem_obj.m, offset, v);
-
-        offset = 0;
-        for (const auto& v : m2t) 
-            offset += queue.write_buffer_async(b_mem_obj.m, offset, v);
-
-        queue.finish();
-        t.start();
-        queue.run2d(k.k, rows, cols, ws, ws);
-        queue.finish();
-        t.stop();
-
-        offset = 0;
-        for (auto& v : res) 
-            offset += queue.read_buffer_async(c_mem_obj.m, offset, &v);
-
-        queue.finish();
+        used = s.gemm_for<Storage>(rows, cols, to_sum).cfg;
+        s.multiply(a, bt, c);
+        prof = get_profile(s.queue);
     }
     catch (clexception& e) {
         cout << "exception! " << e.what() << endl;
         throw;
     }
 
-	return make_tuple(res, t.get_ms());
+	return make_tuple(convert<cl_item>(c), prof, used);
+}
+
+// count independent size x size products in one launch, checked against cpu_gemm
+void ocl_batched_multiplication(session& s, int size, int count) {
+    const size_t stride = size_t(size) * size;
+
+    // product i takes rows [i * size, (i + 1) * size) of every matrix
+    Matrix a(size_t(size) * count, size), bt(size_t(size) * count, size), c(size_t(size) * count, size);
+    for (auto& x : a.items)
+        x = ((rand() % 1001) / 1000.) * 10 - 5;
+    for (auto& x : bt.items)
+        x = ((rand() % 1001) / 1000.) * 10 - 5;
+
+    context& ctx = s.ctx;
+    command_queue& queue = s.queue;
+    sgemm gemm(ctx, s.dd, size, size, size, NULL, count);
+
+    mem_buffer a_mem = ctx.create_buffer(CL_MEM_READ_ONLY, a.size() * sizeof(cl_item));
+    mem_buffer b_mem = ctx.create_buffer(CL_MEM_READ_ONLY, bt.size() * sizeof(cl_item));
+    mem_buffer c_mem = ctx.create_buffer(CL_MEM_WRITE_ONLY, c.size() * sizeof(cl_item));
+
+    queue.write_buffer(a_mem.m, a);
+    queue.write_buffer(b_mem.m, bt);
+    gemm.run_batched(queue, size, size, size, count, a_mem.m, stride, b_mem.m, stride, c_mem.m, stride);
+    queue.read_buffer(c_mem.m, &c);
+    queue.finish();
+    auto prof = get_profile(queue);
+
+    cpu_gemm ref;
+    Matrix r(size, size);
+    double diff = 0;
+    for (int i = 0; i < count; ++i) {
+        ref.run(a.view().row_range(i * size, size), bt.view().row_range(i * size, size), r);
+        auto ci = c.view().row_range(i * size, size);
+        for (int y = 0; y < size; ++y)
+            for (int x = 0; x < size; ++x)
+                diff = max(diff, double(fabs(ci(y, x) - r(y, x))));
+    }
+
+    cout << "OCL batched, " << count << " x " << size << "x" << size << " in one launch: " << prof.kernel_ms << "ms kernel time, "
+         << 2.0 * stride * size * count / prof.kernel_ms / 1e6 << " GFLOPS (" << gemm.cfg << "), max diff with CPU gemm = " << diff << endl;
 }
 
 //
@@ -147,26 +153,22 @@ auto ocl_simple_multiplication(cl_device_id did, const Matrix& m1, const Matrix&
 //
 
 auto random_matrix(int rows, int cols) {
-    Matrix m(rows);
+    Matrix m(rows, cols);
 
-    for (auto& r : m) {
-        r.resize(cols);
-        for (auto& x : r)
-            x = ((rand() % 1001) / 1000.) * 10 - 5;
-    }
+    for (auto& x : m.items)
+        x = ((rand() % 1001) / 1000.) * 10 - 5;
 
     return m;
 }
 
 auto transpose(const Matrix& m) {
-    const int rows = m.size();
-    const int cols = m[0].size();
+    const int rows = m.rows;
+    const int cols = m.cols;
 
-    Matrix t(cols);
+    Matrix t(cols, rows);
 
-    for (size_t i = 0; i < cols; ++i) {
-        t[i].resize(rows);
-        for (size_t j = 0; j < rows; ++j)
+    for (int i = 0; i < cols; ++i) {
+        for (int j = 0; j < rows; ++j)
             t[i][j] = m[j][i];
     }
 
@@ -174,12 +176,12 @@ auto transpose(const Matrix& m) {
 }
 
 auto maxdiff(const Matrix& m1, const Matrix& m2) {
-    if (m1.size() != m2.size() || m1[0].size() != m2[0].size())
+    if (m1.rows != m2.rows || m1.cols != m2.cols)
         throw runtime_error("maxdiff: different matrix size");
 
     double x = 0;
-    for (size_t i = 0; i < m1.size(); ++i) {
-        for (size_t j = 0; j < m1[0].size(); ++j) {
+    for (size_t i = 0; i < m1.rows; ++i) {
+        for (size_t j = 0; j < m1.cols; ++j) {
             double d = fabs(m1[i][j] - m2[i][j]);
             if (x < d) x = d;
         }
@@ -188,26 +190,356 @@ auto maxdiff(const Matrix& m1, const Matrix& m2) {
 }
 
 
+// count small products through separate queue calls, then through a recorded graph with new
+// inputs bound on every replay; the host time per step is what the graph saves
+void ocl_graph_replay(session& s, int size, int count) {
+    const size_t bytes = size_t(size) * size * sizeof(cl_item);
+    vector<Matrix> inputs;
+    for (int i = 0; i < 4; ++i)
+        inputs.push_back(random_matrix(size, size));
+    Matrix c(size, size), c_graph(size, size);
+
+    // a queue without profiling, so no events are made
+    context& ctx = s.ctx;
+    command_queue queue = ctx.create_queue();
+    sgemm& gemm = s.gemm_for<cl_float>(size, size, size);
+
+    mem_buffer a_mem = ctx.create_buffer(CL_MEM_READ_ONLY, bytes);
+    mem_buffer b_mem = ctx.create_buffer(CL_MEM_READ_ONLY, bytes);
+    mem_buffer c_mem = ctx.create_buffer(CL_MEM_WRITE_ONLY, bytes);
+
+    timer t;
+    for (int i = 0; i < count; ++i) {
+        queue.write_buffer_async(a_mem.m, 0, inputs[i % 4]);
+        queue.write_buffer_async(b_mem.m, 0, inputs[(i + 1) % 4]);
+        gemm.run(queue, size, size, size, a_mem.m, b_mem.m, c_mem.m);
+        queue.read_buffer_async(c_mem.m, 0, &c);
+    }
+    queue.finish();
+    const double direct_ms = t.get_ms();
+
+    command_graph g;
+    auto host_a = g.param<void*>();
+    auto host_b = g.param<void*>();
+    size_t wa = g.write(a_mem, 0, bytes, host_a);
+    size_t wb = g.write(b_mem, 0, bytes, host_b);
+    size_t k = g.launch(gemm.pick("sgemm_nt", size, size, size), gemm.range(size, size, 1), {wa, wb},
+                        size, size, size, a_mem, b_mem, c_mem);
+    g.read(c_mem, 0, bytes, c_graph.items.data(), {k});
+
+    timer tg;
+    for (int i = 0; i < count; ++i) {
+        g.set(host_a, (void*)inputs[i % 4].items.data());
+        g.set(host_b, (void*)inputs[(i + 1) % 4].items.data());
+        g.replay(queue);
+    }
+    queue.finish();
+    const double graph_ms = tg.get_ms();
+
+    cout << "OCL, " << count << " steps of " << size << "x" << size << ": " << direct_ms * 1000 / count << "us per step with queue calls, "
+         << graph_ms * 1000 / count << "us replaying a graph, max diff = " << maxdiff(c, c_graph) << endl;
+}
+
+
+// y = A x and Y = A X for a random sparse A of about density * size^2 nonzeros, with every
+// SpMV strategy and with the one chosen from the row lengths; X has n columns
+void ocl_sparse_multiplication(session& s, int size, double density, int n) {
+    vector<coo_entry<cl_item>> entries;
+    for (int i = 0; i < size * size * density; ++i)
+        entries.push_back({rand() % size, rand() % size, cl_item(((rand() % 1001) / 1000.) * 10 - 5)});
+    auto a = csr_matrix<cl_item>::from_coo(size, size, entries);
+    const auto dense = a.to_dense();
+    cout << "sparse: " << a.stats() << ", " << a.bytes() << " bytes as CSR, " << dense.size() * sizeof(cl_item) << " dense\n";
+
+    const auto x = random_matrix(size, 1);
+    const auto X = random_matrix(size, n);
+    const auto y_ref = transpose_multiplication(dense, transpose(x));
+    const auto Y_ref = transpose_multiplication(dense, transpose(X));
+
+    // the results are checked on the device against uploaded references, only the difference is read back
+    device_primitives& prims = s.primitives();
+    cl_mem x_mem = s.buffer("x", x.size() * sizeof(cl_item), CL_MEM_READ_ONLY);
+    cl_mem y_mem = s.buffer("y", y_ref.size() * sizeof(cl_item));
+    cl_mem y_ref_mem = s.buffer("y_ref", y_ref.size() * sizeof(cl_item), CL_MEM_READ_ONLY);
+    s.queue.write_buffer_async(x_mem, 0, x);
+    s.queue.write_buffer_async(y_ref_mem, 0, y_ref);
+
+    for (auto strategy : {spmv_strategy::automatic, spmv_strategy::csr_scalar, spmv_strategy::csr_vector, spmv_strategy::sell}) {
+        sparse_operator<cl_item> op(s.ctx, s.dd, a, strategy);
+        op.spmv(s.queue, x_mem, y_mem);
+        s.queue.finish();
+        auto prof = get_profile(s.queue);
+        const auto diff = prims.compare<cl_item>(s.queue, y_mem, y_ref_mem, size);
+        s.queue.clear_commands();
+        cout << "OCL SpMV, " << (strategy == spmv_strategy::automatic ? "chosen " : "") << spmv_strategy_name(op.strategy) << ": "
+             << prof.kernel_ms << "ms kernel time, max diff = " << diff << endl;
+    }
+
+    sparse_operator<cl_item> op(s.ctx, s.dd, a);
+    cl_mem X_mem = s.buffer("X", X.size() * sizeof(cl_item), CL_MEM_READ_ONLY);
+    cl_mem Y_mem = s.buffer("Y", Y_ref.size() * sizeof(cl_item));
+    cl_mem Y_ref_mem = s.buffer("Y_ref", Y_ref.size() * sizeof(cl_item), CL_MEM_READ_ONLY);
+    s.queue.write_buffer_async(X_mem, 0, X);
+    s.queue.write_buffer_async(Y_ref_mem, 0, Y_ref);
+    op.spmm(s.queue, n, X_mem, n, Y_mem, n);
+    s.queue.finish();
+    auto prof = get_profile(s.queue);
+    cout << "OCL SpMM with " << n << " columns, " << spmv_strategy_name(op.strategy) << ": " << prof.kernel_ms
+         << "ms kernel time, max diff = " << prims.compare<cl_item>(s.queue, Y_mem, Y_ref_mem, Y_ref.size()) << endl;
+    s.queue.clear_commands();
+}
+
+
+// sum, largest element and prefix sums of count random values on the device, against the host
+void ocl_reduce_scan(session& s, int count) {
+    vector<cl_int> v(count), scanned(count);
+    for (auto& x : v)
+        x = rand() % 1001 - 500;
+    cl_mem v_mem = s.buffer("v", count * sizeof(cl_int));
+    cl_mem scan_mem = s.buffer("scan", count * sizeof(cl_int));
+    s.queue.write_buffer(v_mem, v);
+
+    device_primitives& prims = s.primitives();
+    timer t;
+    const cl_int sum = prims.reduce<cl_int>(s.queue, v_mem, count);
+    const auto top = prims.arg_reduce<cl_int>(s.queue, v_mem, count, combine_op::max<cl_int>());
+    prims.scan<cl_int>(s.queue, v_mem, scan_mem, count);
+    s.queue.read_buffer(scan_mem, &scanned);
+    const double ms = t.get_ms();
+    s.queue.clear_commands();
+
+    cl_int host_sum = 0;
+    bool scan_ok = true;
+    for (int i = 0; i < count; ++i) {
+        host_sum += v[i];
+        scan_ok = scan_ok && scanned[i] == host_sum;
+    }
+    const auto host_top = max_element(v.begin(), v.end()) - v.begin();
+    cout << "OCL reduce and scan of " << count << " ints: " << ms << "ms, sum " << (sum == host_sum ? "ok" : "WRONG")
+         << ", max " << top.value << " at " << top.index << (top.index == host_top ? " ok" : " WRONG")
+         << ", scan " << (scan_ok ? "ok" : "WRONG") << endl;
+
+    // 16-bit elements: the identities of min and max are SHRT_MAX and SHRT_MIN in OpenCL C
+    vector<cl_short> h(count);
+    for (auto& x : h)
+        x = cl_short(rand() % 60001 - 30000);
+    cl_mem h_mem = s.buffer("v16", count * sizeof(cl_short));
+    s.queue.write_buffer(h_mem, h);
+    const cl_short low = prims.reduce<cl_short>(s.queue, h_mem, count, combine_op::min<cl_short>());
+    const auto high = prims.arg_reduce<cl_short>(s.queue, h_mem, count, combine_op::max<cl_short>());
+    s.queue.clear_commands();
+    const auto host_high = max_element(h.begin(), h.end()) - h.begin();
+    cout << "OCL min and max of " << count << " shorts: min " << low << (low == *min_element(h.begin(), h.end()) ? " ok" : " WRONG")
+         << ", max at " << high.index << (high.index == host_high ? " ok" : " WRONG") << endl;
+}
+
+
+// count size x size products spread over host threads sharing one context: every thread
+// submits to its queue of the pool with its own kernel clones
+void ocl_concurrent_multiplication(const device_description& dev, program_cache* cache, tuning_table* tuning, int size, int count) {
+    const auto a = random_matrix(size, size);
+    const auto bt = random_matrix(size, size);
+    const auto ref = transpose_multiplication(a, bt);
+    const size_t bytes = a.size() * sizeof(cl_item);
+
+    for (int threads : {1, 2, 4, 8}) {
+        shared_runtime rt(dev, 0, cache, tuning);
+        rt.gemm_for<cl_item>(size, size, size);     // built before the clock starts
+        vector<double> diffs(threads);
+        vector<exception_ptr> errors(threads);
+
+        timer t;
+        vector<thread> workers;
+        for (int i = 0; i < threads; ++i) {
+            workers.emplace_back([&, i] {
+                try {
+                    mem_buffer a_mem = rt.ctx.create_buffer(CL_MEM_READ_ONLY, bytes);
+                    mem_buffer b_mem = rt.ctx.create_buffer(CL_MEM_READ_ONLY, bytes);
+                    mem_buffer c_mem = rt.ctx.create_buffer(CL_MEM_WRITE_ONLY, bytes);
+                    Matrix c(size, size);
+                    command_queue& q = rt.queue();
+                    for (int j = i; j < count; j += threads) {
+                        q.write_buffer_async(a_mem.m, 0, a);
+                        q.write_buffer_async(b_mem.m, 0, bt);
+                        rt.multiply<cl_item>(size, size, size, a_mem.m, b_mem.m, c_mem.m);
+                        q.read_buffer_async(c_mem.m, 0, &c);
+                    }
+                    q.finish();
+                    diffs[i] = maxdiff(ref, c);
+                }
+                catch (...) {
+                    errors[i] = current_exception();
+                }
+            });
+        }
+        for (auto& w : workers)
+            w.join();
+        const double ms = t.get_ms();
+        for (auto& e : errors)
+            if (e)
+                rethrow_exception(e);
+
+        cout << "OCL, " << threads << " host threads on " << rt.queues.size() << " queues: " << count / ms * 1000
+             << " products of " << size << "x" << size << " per second, max diff = " << *max_element(diffs.begin(), diffs.end()) << endl;
+    }
+}
+
+
+// The same product through matrix files in dir: the inputs are mapped and used by the
+// device in place (CL_MEM_USE_HOST_PTR), the result goes to a mapped output file
+Matrix ocl_file_multiplication(session& s, const string& dir, const Matrix& m1, const Matrix& m2t) {
+    matrix_file::save<cl_item>(dir + "/a.mat", m1);
+    matrix_file::save<cl_item>(dir + "/bt.mat", m2t);
+
+    timer t;
+    matrix_file fa(dir + "/a.mat");
+    matrix_file fbt(dir + "/bt.mat");
+    const int rows = fa.rows();
+    const int cols = fbt.rows();
+    const int to_sum = fa.cols();
+    auto fc = matrix_file::create<cl_item>(dir + "/c.mat", rows, cols);
+
+    mem_buffer a_mem = fa.create_buffer(s.ctx, CL_MEM_READ_ONLY);
+    mem_buffer b_mem = fbt.create_buffer(s.ctx, CL_MEM_READ_ONLY);
+    mem_buffer c_mem = fc.create_buffer(s.ctx, CL_MEM_WRITE_ONLY);
+
+    s.multiply<cl_item>(rows, cols, to_sum, a_mem.m, b_mem.m, c_mem.m);
+    fc.fetch(s.queue, c_mem.m);
+    s.queue.clear_commands();
+    fc.sync();
+    cout << "OCL from files in " << dir << ": " << t.get_ms() << "ms whole time\n";
+
+    Matrix res(rows, cols);
+    copy(matrix_file(dir + "/c.mat").view<const cl_item>(), res.view());
+    return res;
+}
+
+
 int main(int argc, char* argv[])
 {
-    auto devices = get_devices();
+    vector<device_description> devices;
+    try {
+        devices = get_devices();
+    }
+    catch (clexception& e) {
+        cout << "no OpenCL platform: " << e.what() << endl;
+    }
 
     const int a = (argc > 1) ? atoi(argv[1]) : 1024;
+    int bits = (argc > 2) ? atoi(argv[2]) : 32;     // storage precision of the OpenCL gemm: 16, 32 or 64
+    if (bits != 16 && bits != 32 && bits != 64) {
+        cout << "precision must be 16, 32 or 64 bits, not " << argv[2] << endl;
+        return 1;
+    }
     const int cpu_max = 2048;
+    const double flop = 2.0 * a * a * a;
 
     auto m1 = random_matrix(a, a);
     auto m2 = random_matrix(a, a);
     auto m2t = transpose(m2);
 
-    Matrix res;
-
-    for (auto ws : {1, 2, 4, 8, 16})
+    // blocked SIMD gemm on the host: the baseline for the OpenCL numbers, and the result without a device
+    Matrix res(a, a);
     {
+        cpu_gemm gemm;
         timer t;
-        auto [m, it] = ocl_simple_multiplication(devices[0].id, m1, m2t, kernel_two_dims_t, ws);
+        gemm.run(m1, m2t, res);
         auto tms = t.get_ms();
-        res = std::move(m);
-        cout << "OCL: " << it << "ms kernel time; " << tms << " ms whole time (ws=" << ws << ")\n"; 
+        cout << "CPU gemm: " << tms << "ms, " << flop / tms / 1e6 << " GFLOPS (" << gemm.isa_name() << ", "
+             << gemm.pool.size() << " threads)\n";
+    }
+
+    program_cache cache;
+    tuning_table tuning;
+
+    if (!devices.empty()) {
+        // 2 a^3 flops over 3 a^2 floats moved
+        workload_profile w(flop / (3.0 * m1.size() * sizeof(cl_item)));
+        w.memory = 3 * m1.size() * sizeof(cl_item);
+        const auto& dev = select_device(devices, w);
+        cout << "device: " << dev.name << ", ~" << score(dev, w) << " GFLOPS estimated\n";
+
+        if (bits == 64 && !dev.fp64()) {
+            cout << dev.name << " has no double precision, running single\n";
+            bits = 32;
+        }
+
+        // context, queue, kernels and buffers for all runs on the device below
+        session s(dev, &cache, &tuning, CL_QUEUE_PROFILING_ENABLE);
+
+        // tuned once per device and shape bucket, later runs take the result from the tuning file;
+        // the tuning runs in single precision, other precisions take the first fitting configuration
+        gemm_config cfg;
+        if (bits == 32 && !find_tuned_gemm(tuning, dev, a, a, a, &cfg)) {
+            command_queue queue = s.ctx.create_queue();
+            vector<tuned_config> measured;
+            cfg = tune_sgemm(tuning, s.ctx, queue, dev, a, a, a, &measured);
+            for (const auto& t : measured)
+                cout << "tune: " << t.ms << "ms (" << t.options << ")\n";
+        }
+
+        // the first call builds the kernel and allocates the buffers, the second finds them ready
+        for (int i = 0; i < 2; ++i) {
+            timer t;
+            auto [m, prof, used] = (bits == 16) ? ocl_simple_multiplication<half>(s, m1, m2t)
+                                 : (bits == 64) ? ocl_simple_multiplication<cl_double>(s, m1, m2t)
+                                 : ocl_simple_multiplication<cl_float>(s, m1, m2t);
+            auto tms = t.get_ms();
+            cout << "OCL, " << bits << " bit, " << (i ? "warm" : "cold") << ": " << prof.kernel_ms << "ms kernel time, "
+                 << flop / prof.kernel_ms / 1e6 << " GFLOPS; " << tms << " ms whole time (" << used << ")\n";
+            if (i == 1) {
+                cout << prof;
+                // the result is still on the device in single precision: checked there against the CPU gemm
+                if (bits == 32) {
+                    cl_mem ref = s.buffer("ref", res.size() * sizeof(cl_item), CL_MEM_READ_ONLY);
+                    s.queue.write_buffer(ref, res);
+                    cout << "max diff with CPU gemm = " << s.primitives().compare<cl_item>(s.queue, s.buffer("c", 0), ref, res.size()) << endl;
+                    s.queue.clear_commands();
+                }
+                else
+                    cout << "max diff with CPU gemm = " << maxdiff(res, m) << endl;
+                res = std::move(m);
+            }
+        }
+
+        ocl_batched_multiplication(s, 32, 4096);
+        ocl_graph_replay(s, 32, 1000);
+        ocl_sparse_multiplication(s, a, 0.02, 16);
+        ocl_reduce_scan(s, 1 << 20);
+        ocl_concurrent_multiplication(dev, &cache, &tuning, 64, 512);
+
+        // a directory for matrix files as the third argument
+        if (argc > 3 && bits == 32)
+            cout << "max diff of the file result = " << maxdiff(res, ocl_file_multiplication(s, argv[3], m1, m2t)) << endl;
+
+        // a CPU runtime split per NUMA node (or cache domain, or just in two halves), a queue for each part
+        if ((dev.type & CL_DEVICE_TYPE_CPU) && dev.units >= 2) {
+            auto parts = sub_device_set::by_affinity(dev.id);
+            if (parts.size() < 2 && sub_device_set::supports(dev.id, CL_DEVICE_PARTITION_EQUALLY))
+                parts = sub_device_set::equally(dev.id, dev.units / 2);
+            if (parts.size() > 1) {
+                multi_device_gemm gemm(parts.devices, &cache, &tuning);
+                Matrix res_sub(a, a);
+                for (int i = 0; i < 2; ++i) {
+                    timer t;
+                    gemm.run(m1, m2t, res_sub);
+                    cout << "OCL, " << parts.size() << " sub-devices: " << t.get_ms() << "ms (" << gemm << ")\n";
+                }
+                cout << "max diff with one device = " << maxdiff(res, res_sub) << endl;
+            }
+        }
+    }
+
+    if (devices.size() > 1) {
+        multi_device_gemm gemm(devices, &cache, &tuning);
+        Matrix res_md(a, a);
+        // the first run splits by compute units, the second by measured throughput
+        for (int i = 0; i < 2; ++i) {
+            timer t;
+            gemm.run(m1, m2t, res_md);
+            cout << "OCL, " << devices.size() << " devices: " << t.get_ms() << "ms (" << gemm << ")\n";
+        }
+        cout << "max diff with one device = " << maxdiff(res, res_md) << endl;
     }
 
 
@@ -215,11 +547,17 @@ int main(int argc, char* argv[])
         Matrix res_ref;
         timer t;
         res_ref = transpose_multiplication(m1, m2t);
-        cout << "CPU: " << t.get_ms() << "ms\n";
+        cout << "CPU naive: " << t.get_ms() << "ms\n";
 
         if (res_ref == res)
-            cout << "res_ref == res_ocl" << endl;
+            cout << "res_ref == res" << endl;
         else
-            cout << "res_ref != res_ocl, max diff = " << maxdiff(res_ref, res) << endl;
+            cout << "res_ref != res, max diff = " << maxdiff(res_ref, res) << endl;
     }
+
+#ifdef OCL_TRACE
+    // built with -DOCL_TRACE: the timeline of all runs above, for chrome://tracing or ui.perfetto.dev
+    if (trace_dump("test2_trace.json"))
+        cout << "trace written to test2_trace.json\n";
+#endif
 }